@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <math.h>
+
+#include "bloom.h"
+
+#define BITS_PER_WORD (sizeof(unsigned long) * CHAR_BIT)
+
+#define BLOOM_MIN_BITS 1024
+
+#define BLOOM_MAX_HASHES 16
+
+/* Final avalanche step of splitmix64, so that the two halves used for
+   double hashing are independent enough. */
+static unsigned long long mix64(unsigned long long h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+struct bloom_filter *bloom_new(long expected, double fp_rate)
+{
+	struct bloom_filter *bf;
+	double m;
+	unsigned long nbits;
+	int k;
+
+	if (expected <= 0)
+		expected = 1;
+	if (fp_rate <= 0.0 || fp_rate >= 1.0)
+		fp_rate = 0.01;
+
+	/* m = -n ln(p) / (ln 2)^2, k = m / n ln 2 */
+	m = -(double)expected * log(fp_rate) / (M_LN2 * M_LN2);
+
+	nbits = BLOOM_MIN_BITS;
+	while (nbits < m)
+		nbits <<= 1;
+
+	k = (int)((double)nbits / expected * M_LN2 + 0.5);
+	if (k < 1)
+		k = 1;
+	if (k > BLOOM_MAX_HASHES)
+		k = BLOOM_MAX_HASHES;
+
+	bf = (struct bloom_filter *)calloc(1, sizeof(struct bloom_filter));
+	if (bf == NULL)
+		return NULL;
+
+	bf->bits = (unsigned long *)calloc(nbits / BITS_PER_WORD,
+									   sizeof(unsigned long));
+	if (bf->bits == NULL)
+	{
+		free(bf);
+		return NULL;
+	}
+
+	bf->mask = nbits - 1;
+	bf->nhashes = k;
+	bf->expected = expected;
+	bf->target_fp_rate = fp_rate;
+
+	return bf;
+}
+
+void bloom_delete(struct bloom_filter *bf)
+{
+	free(bf->bits);
+	free(bf);
+}
+
+/* Kirsch-Mitzenmacher: the i-th probe is h1 + i * h2. */
+#define BLOOM_PROBE(h1, h2, i, mask) (((h1) + (i) * (h2)) & (mask))
+
+void bloom_add_hash(struct bloom_filter *bf, unsigned long long h)
+{
+	unsigned long h1 = (unsigned long)h;
+	unsigned long h2 = (unsigned long)mix64(h) | 1;
+	int i;
+
+	for (i = 0; i < bf->nhashes; i++)
+	{
+		unsigned long bit = BLOOM_PROBE(h1, h2, (unsigned long)i, bf->mask);
+		unsigned long *word = &bf->bits[bit / BITS_PER_WORD];
+		unsigned long flag = 1UL << (bit % BITS_PER_WORD);
+
+		if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & flag))
+			__atomic_fetch_or(word, flag, __ATOMIC_RELEASE);
+	}
+}
+
+int bloom_maybe_contains_hash(struct bloom_filter *bf, unsigned long long h)
+{
+	unsigned long h1 = (unsigned long)h;
+	unsigned long h2 = (unsigned long)mix64(h) | 1;
+	int i;
+
+	for (i = 0; i < bf->nhashes; i++)
+	{
+		unsigned long bit = BLOOM_PROBE(h1, h2, (unsigned long)i, bf->mask);
+		unsigned long word;
+
+		word = __atomic_load_n(&bf->bits[bit / BITS_PER_WORD],
+							   __ATOMIC_ACQUIRE);
+		if (!(word & (1UL << (bit % BITS_PER_WORD))))
+		{
+			__atomic_fetch_add(&bf->negatives, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Called by the owner of the exact table after a positive answer has
+   been checked, so that the real false-positive rate can be measured. */
+void bloom_record(struct bloom_filter *bf, int false_positive)
+{
+	if (false_positive)
+		__atomic_fetch_add(&bf->false_positives, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&bf->true_positives, 1, __ATOMIC_RELAXED);
+}
+
+/* False positives over all queries for keys that were not in the set. */
+double bloom_measured_fp_rate(struct bloom_filter *bf)
+{
+	unsigned long fp, neg;
+
+	fp = __atomic_load_n(&bf->false_positives, __ATOMIC_RELAXED);
+	neg = __atomic_load_n(&bf->negatives, __ATOMIC_RELAXED);
+
+	if (fp + neg == 0)
+		return 0.0;
+
+	return (double)fp / (double)(fp + neg);
+}
@@ -0,0 +1,39 @@
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+/*
+ * Approximate membership filter used in front of the exact seen-set.
+ * Inserts and queries are lock-free, so any number of threads may
+ * use the filter concurrently.  A negative answer is exact; a positive
+ * answer must be confirmed against the real table.
+ */
+
+struct bloom_filter
+{
+	unsigned long *bits;
+	unsigned long mask;		/* number of bits - 1, a power of two */
+	int nhashes;
+
+	long expected;
+	double target_fp_rate;
+
+	/* statistics, updated atomically */
+	unsigned long negatives;	/* queries answered "absent" */
+	unsigned long true_positives;
+	unsigned long false_positives;
+};
+
+extern struct bloom_filter *bloom_new(long expected, double fp_rate);
+
+extern void bloom_delete(struct bloom_filter *bf);
+
+extern void bloom_add_hash(struct bloom_filter *bf, unsigned long long h);
+
+extern int bloom_maybe_contains_hash(struct bloom_filter *bf,
+									 unsigned long long h);
+
+extern void bloom_record(struct bloom_filter *bf, int false_positive);
+
+extern double bloom_measured_fp_rate(struct bloom_filter *bf);
+
+#endif
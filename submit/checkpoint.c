@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "checkpoint.h"
+
+#define MANIFEST_NAME "manifest"
+
+static void file_path(const char *dir, const char *name, char *buf, int size)
+{
+	snprintf(buf, size, "%s/%s", dir, name);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int sync_dir(const char *dir)
+{
+	int fd = open(dir, O_RDONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/* Append LEN bytes to DIR/NAME and flush them to disk. */
+int checkpoint_append(const char *dir,
+					  const char *name,
+					  const void *buf,
+					  size_t len)
+{
+	char path[4096];
+	int fd;
+
+	file_path(dir, name, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		perror("Can't open checkpoint file");
+		return -1;
+	}
+
+	if (write_all(fd, buf, len) < 0 || fsync(fd) < 0)
+	{
+		perror("Failed to write checkpoint file");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Replace DIR/NAME with BUF: readers see either the old or the new
+   contents, never a mix. */
+int checkpoint_replace(const char *dir,
+					   const char *name,
+					   const void *buf,
+					   size_t len)
+{
+	char path[4096], tmp[sizeof(path) + 4];	/* room for PATH.tmp */
+	int fd;
+
+	file_path(dir, name, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror("Can't open checkpoint file");
+		return -1;
+	}
+
+	if (write_all(fd, buf, len) < 0 || fsync(fd) < 0)
+	{
+		perror("Failed to write checkpoint file");
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0)
+	{
+		perror("Failed to install checkpoint file");
+		unlink(tmp);
+		return -1;
+	}
+
+	return sync_dir(dir);
+}
+
+/* Cut DIR/NAME back to its committed length, dropping whatever an
+   interrupted checkpoint appended. */
+int checkpoint_truncate(const char *dir, const char *name, size_t len)
+{
+	char path[4096];
+
+	file_path(dir, name, path, sizeof(path));
+	if (truncate(path, len) < 0 && !(errno == ENOENT && len == 0))
+	{
+		perror("Can't truncate checkpoint file");
+		return -1;
+	}
+	return 0;
+}
+
+/* Map the first LEN bytes of DIR/NAME read-only.  Returns NULL on
+   error, or if LEN is 0. */
+void *checkpoint_map(const char *dir, const char *name, size_t len)
+{
+	char path[4096];
+	struct stat st;
+	void *addr;
+	int fd;
+
+	if (len == 0)
+		return NULL;
+
+	file_path(dir, name, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror("Can't open checkpoint file");
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < len)
+	{
+		fprintf(stderr, "Checkpoint file %s is truncated!\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED)
+	{
+		perror("Can't map checkpoint file");
+		return NULL;
+	}
+
+	madvise(addr, len, MADV_SEQUENTIAL);
+	return addr;
+}
+
+void checkpoint_unmap(void *addr, size_t len)
+{
+	if (addr)
+		munmap(addr, len);
+}
+
+void checkpoint_state_name(uint64_t generation, char *buf, int size)
+{
+	snprintf(buf, size, "state.%llu", (unsigned long long)generation);
+}
+
+/* Returns 0 if DIR holds a valid manifest, -1 otherwise. */
+int checkpoint_read_manifest(const char *dir, struct checkpoint_manifest *m)
+{
+	char path[4096];
+	FILE *fp;
+	int ok;
+
+	file_path(dir, MANIFEST_NAME, path, sizeof(path));
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return -1;
+
+	ok = fread(m, sizeof(*m), 1, fp) == 1 &&
+		memcmp(m->magic, CHECKPOINT_MAGIC, sizeof(m->magic)) == 0;
+	fclose(fp);
+
+	return ok ? 0 : -1;
+}
+
+/* Start DIR afresh for a new crawl.  The files are appended to and the
+   new crawl's manifests count from 0, so whatever an earlier crawl left
+   there has to go: the manifest first, so that an interrupted clear
+   leaves nothing to resume. */
+int checkpoint_clear(const char *dir)
+{
+	static const char *const files[] = { "nodes", "links", "strings" };
+	struct checkpoint_manifest m;
+	char name[64], path[4096];
+	int i;
+
+	if (checkpoint_read_manifest(dir, &m) == 0)
+	{
+		file_path(dir, MANIFEST_NAME, path, sizeof(path));
+		if (unlink(path) < 0 || sync_dir(dir) < 0)
+		{
+			perror("Can't remove checkpoint manifest");
+			return -1;
+		}
+
+		checkpoint_state_name(m.generation, name, sizeof(name));
+		file_path(dir, name, path, sizeof(path));
+		unlink(path);
+	}
+
+	for (i = 0; i < (int)(sizeof(files) / sizeof(files[0])); i++)
+		if (checkpoint_truncate(dir, files[i], 0) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Make M the current checkpoint, then drop the state file of the one
+   it replaces. */
+int checkpoint_commit(const char *dir, const struct checkpoint_manifest *m)
+{
+	char name[64], path[4096];
+
+	if (checkpoint_replace(dir, MANIFEST_NAME, m, sizeof(*m)) < 0)
+		return -1;
+
+	if (m->generation > 0)
+	{
+		checkpoint_state_name(m->generation - 1, name, sizeof(name));
+		file_path(dir, name, path, sizeof(path));
+		unlink(path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk crawl checkpoints.
+ *
+ * The graph is kept in append-only files that grow by what was added
+ * since the previous checkpoint: "nodes" and "links" are arrays of the
+ * fixed-size records below and "strings" holds the NUL-terminated URLs
+ * the nodes point into.  The frontier's page states are small and are
+ * written whole, to one "state.<generation>" file per checkpoint.
+ *
+ * The manifest is the commit point.  It is replaced atomically and
+ * records the generation and how much of each file is valid, so a
+ * crash in the middle of a checkpoint leaves the previous one usable.
+ * Records are in host byte order and are read back with mmap.
+ */
+
+#define CHECKPOINT_MAGIC "SACKPT02"
+
+struct checkpoint_manifest
+{
+	char magic[8];
+	uint64_t generation;
+	uint64_t nodes;
+	uint64_t links;
+	uint64_t string_bytes;
+	uint64_t states;
+	int64_t pages_fetched;
+};
+
+struct checkpoint_node
+{
+	uint64_t fp;
+	uint64_t offset;	/* of the URL in "strings" */
+};
+
+struct checkpoint_link
+{
+	int64_t src;
+	int64_t dest;
+};
+
+extern int checkpoint_append(const char *dir,
+							 const char *name,
+							 const void *buf,
+							 size_t len);
+
+extern int checkpoint_replace(const char *dir,
+							  const char *name,
+							  const void *buf,
+							  size_t len);
+
+extern int checkpoint_truncate(const char *dir, const char *name, size_t len);
+
+extern void *checkpoint_map(const char *dir, const char *name, size_t len);
+
+extern void checkpoint_unmap(void *addr, size_t len);
+
+extern void checkpoint_state_name(uint64_t generation, char *buf, int size);
+
+extern int checkpoint_read_manifest(const char *dir,
+									struct checkpoint_manifest *m);
+
+extern int checkpoint_commit(const char *dir,
+							 const struct checkpoint_manifest *m);
+
+extern int checkpoint_clear(const char *dir);
+
+#endif
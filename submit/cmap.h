@@ -0,0 +1,409 @@
+#ifndef _CMAP_H
+#define _CMAP_H
+
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "htable.h"
+
+/*
+ * Concurrent hash map.
+ *
+ * The keys are spread over a number of shards by the top bits of their
+ * hash, each shard being a hash table with a read-write lock of its
+ * own.  Threads working on different shards never contend, and lookups
+ * in the same shard run in parallel; only inserts into one shard are
+ * serialized.  With many more shards than threads that is rarely felt.
+ *
+ * CMAP_DEFINE(name, table, key_t, value_t) defines struct name over
+ * shards of TABLE, a table type defined with HTABLE_DEFINE from key_t
+ * to value_t, and static inline functions name_new, name_get and so on
+ * to use it.  A key is hashed once per operation, for both its shard
+ * and its place in the shard's table.
+ *
+ * Since the shards are independent, a map can also be filled from an
+ * array of keys on all cores at once with name_build, e.g. when a crawl
+ * is resumed.
+ */
+
+#define CMAP_CACHE_LINE 64
+
+/* The most threads a map's _build runs on. */
+#define CMAP_MAX_BUILD_THREADS 64
+
+#define CMAP_DEFINE(name, table, key_t, value_t)						\
+																		\
+/* Called under the shard lock when KEY is being inserted: sets *VALUE,	\
+   and may replace *KEY by the copy of it the map should keep.  Returns	\
+   0, or -1 if KEY cannot be inserted after all. */						\
+typedef int (*name##_insert_fn)(void *arg, key_t *key, value_t *value);	\
+																		\
+/* Each shard's lock on cache lines of its own. */						\
+struct name##_shard														\
+{																		\
+	pthread_rwlock_t lock;												\
+	struct table table;													\
+} __attribute__((aligned(CMAP_CACHE_LINE)));							\
+																		\
+struct name																\
+{																		\
+	struct name##_shard *shards;										\
+	int nshards;	/* a power of two */								\
+	int shift;		/* hash >> shift is the shard */					\
+};																		\
+																		\
+static inline int name##_shard_index(struct name *m, unsigned long hash) \
+{																		\
+	/* The tables place keys by the low bits of the hash; the top bits	\
+	   are independent of those. */										\
+	if (m->nshards == 1)												\
+		return 0;														\
+	return hash >> m->shift;											\
+}																		\
+																		\
+static inline struct name##_shard *name##_shard_of(struct name *m,		\
+												   unsigned long hash)	\
+{																		\
+	return &m->shards[name##_shard_index(m, hash)];						\
+}																		\
+																		\
+																		\
+/* Make a map of SHARDS tables (rounded up to a power of two), sized	\
+   for ITEMS keys in all. */											\
+static inline struct name *name##_new(int shards, long items)			\
+{																		\
+	struct name *m;														\
+	void *p;															\
+	int bits, i;														\
+																		\
+	for (bits = 0; (1 << bits) < shards; bits++)						\
+		;																\
+																		\
+	m = (struct name *)calloc(1, sizeof(struct name));					\
+	if (m == NULL)														\
+		return NULL;													\
+																		\
+	if (posix_memalign(&p, CMAP_CACHE_LINE,								\
+					   (1 << bits) * sizeof(struct name##_shard)) != 0)	\
+	{																	\
+		free(m);														\
+		return NULL;													\
+	}																	\
+	m->shards = (struct name##_shard *)p;								\
+	m->nshards = 1 << bits;												\
+	m->shift = sizeof(unsigned long) * CHAR_BIT - bits;					\
+																		\
+	for (i = 0; i < m->nshards; i++)									\
+	{																	\
+		pthread_rwlock_init(&m->shards[i].lock, NULL);					\
+		table##_init(&m->shards[i].table, items / m->nshards);			\
+	}																	\
+																		\
+	return m;															\
+}																		\
+																		\
+static inline void name##_delete(struct name *m)						\
+{																		\
+	int i;																\
+																		\
+	for (i = 0; i < m->nshards; i++)									\
+	{																	\
+		table##_destroy(&m->shards[i].table);							\
+		pthread_rwlock_destroy(&m->shards[i].lock);						\
+	}																	\
+	free(m->shards);													\
+	free(m);															\
+}																		\
+																		\
+/* Look KEY up; returns 1 and its value in *VALUE if it is there. */	\
+static inline int name##_get(struct name *m, key_t key, value_t *value)	\
+{																		\
+	unsigned long hash = table##_hash(key);								\
+	struct name##_shard *s = name##_shard_of(m, hash);					\
+	struct table##_cell *c;												\
+																		\
+	pthread_rwlock_rdlock(&s->lock);									\
+	c = table##_find(&s->table, key, hash);								\
+	if (c)																\
+		*value = c->value;												\
+	pthread_rwlock_unlock(&s->lock);									\
+																		\
+	return c != NULL;													\
+}																		\
+																		\
+/* name##_get_or_insert for a KEY that is most likely absent, e.g.	\
+   one a filter of the keys has never seen: goes straight for the		\
+   write lock, without a lookup under the read lock first. */			\
+static inline int name##_insert_absent(struct name *m,					\
+									   key_t key,						\
+									   name##_insert_fn fn,				\
+									   void *arg,						\
+									   value_t *value)					\
+{																		\
+	unsigned long hash = table##_hash(key);								\
+	struct name##_shard *s = name##_shard_of(m, hash);					\
+	struct table##_cell *c;												\
+																		\
+	pthread_rwlock_wrlock(&s->lock);									\
+	c = table##_find(&s->table, key, hash);								\
+	if (c)																\
+	{																	\
+		*value = c->value;												\
+		pthread_rwlock_unlock(&s->lock);								\
+		return 0;														\
+	}																	\
+	if (fn(arg, &key, value) < 0)										\
+	{																	\
+		pthread_rwlock_unlock(&s->lock);								\
+		return -1;														\
+	}																	\
+	table##_insert(&s->table, key, hash, *value);						\
+	pthread_rwlock_unlock(&s->lock);									\
+																		\
+	return 1;															\
+}																		\
+																		\
+/* Atomic insert-if-absent.  If KEY is there, store its value in *VALUE	\
+   and return 0.  Otherwise FN makes the key and value to insert, under	\
+   the shard lock so that no one else inserts KEY meanwhile, and 1 is	\
+   returned, or -1 if FN fails. */										\
+static inline int name##_get_or_insert(struct name *m,					\
+									   key_t key,						\
+									   name##_insert_fn fn,				\
+									   void *arg,						\
+									   value_t *value)					\
+{																		\
+	unsigned long hash = table##_hash(key);								\
+	struct name##_shard *s = name##_shard_of(m, hash);					\
+	struct table##_cell *c;												\
+																		\
+	/* Most keys asked for are there already: try under the read lock	\
+	   first. */														\
+	pthread_rwlock_rdlock(&s->lock);									\
+	c = table##_find(&s->table, key, hash);								\
+	if (c)																\
+		*value = c->value;												\
+	pthread_rwlock_unlock(&s->lock);									\
+	if (c)																\
+		return 0;														\
+																		\
+	return name##_insert_absent(m, key, fn, arg, value);				\
+}																		\
+																		\
+static inline void name##_put(struct name *m, key_t key, value_t value)	\
+{																		\
+	unsigned long hash = table##_hash(key);								\
+	struct name##_shard *s = name##_shard_of(m, hash);					\
+																		\
+	pthread_rwlock_wrlock(&s->lock);									\
+	table##_put_hashed(&s->table, key, hash, value);					\
+	pthread_rwlock_unlock(&s->lock);									\
+}																		\
+																		\
+static inline long name##_count(struct name *m)							\
+{																		\
+	long n = 0;															\
+	int i;																\
+																		\
+	for (i = 0; i < m->nshards; i++)									\
+	{																	\
+		pthread_rwlock_rdlock(&m->shards[i].lock);						\
+		n += table##_count(&m->shards[i].table);						\
+		pthread_rwlock_unlock(&m->shards[i].lock);						\
+	}																	\
+																		\
+	return n;															\
+}																		\
+																		\
+/* Make room for ITEMS keys in all.  See the table's reserve. */		\
+static inline void name##_reserve(struct name *m, long items)			\
+{																		\
+	int i;																\
+																		\
+	for (i = 0; i < m->nshards; i++)									\
+	{																	\
+		pthread_rwlock_wrlock(&m->shards[i].lock);						\
+		table##_reserve(&m->shards[i].table,							\
+						table##_count(&m->shards[i].table) +			\
+						items / m->nshards);							\
+		pthread_rwlock_unlock(&m->shards[i].lock);						\
+	}																	\
+}																		\
+																		\
+/* The part of name##_build done by one of its threads. */				\
+struct name##_build_arg													\
+{																		\
+	struct name *m;														\
+	const key_t *keys;													\
+	const value_t *values;												\
+	unsigned long *hashes;												\
+	long *order;	/* indices of the keys, grouped by shard */			\
+	long *pos;		/* [thread][shard]: counts, then places in ORDER */	\
+	long *starts;	/* [shard]: where its keys start in ORDER */		\
+	long begin, end;	/* this thread's keys */						\
+	int thread, nthreads;												\
+	long added;															\
+};																		\
+																		\
+static inline void *name##_build_hash(void *p)							\
+{																		\
+	struct name##_build_arg *a = (struct name##_build_arg *)p;			\
+	long *count = a->pos + (long)a->thread * a->m->nshards;				\
+	long i;																\
+																		\
+	for (i = a->begin; i < a->end; i++)									\
+	{																	\
+		a->hashes[i] = table##_hash(a->keys[i]);						\
+		count[name##_shard_index(a->m, a->hashes[i])]++;				\
+	}																	\
+	return NULL;														\
+}																		\
+																		\
+static inline void *name##_build_scatter(void *p)						\
+{																		\
+	struct name##_build_arg *a = (struct name##_build_arg *)p;			\
+	long *pos = a->pos + (long)a->thread * a->m->nshards;				\
+	long i;																\
+																		\
+	for (i = a->begin; i < a->end; i++)									\
+		a->order[pos[name##_shard_index(a->m, a->hashes[i])]++] = i;	\
+	return NULL;														\
+}																		\
+																		\
+static inline void *name##_build_insert(void *p)						\
+{																		\
+	struct name##_build_arg *a = (struct name##_build_arg *)p;			\
+	int s;																\
+	long j;																\
+																		\
+	for (s = a->thread; s < a->m->nshards; s += a->nthreads)			\
+	{																	\
+		struct name##_shard *shard = &a->m->shards[s];					\
+																		\
+		pthread_rwlock_wrlock(&shard->lock);							\
+		table##_reserve(&shard->table, table##_count(&shard->table) +	\
+						a->starts[s + 1] - a->starts[s]);				\
+		for (j = a->starts[s]; j < a->starts[s + 1]; j++)				\
+		{																\
+			long i = a->order[j];										\
+																		\
+			if (table##_find(&shard->table, a->keys[i], a->hashes[i]))	\
+				continue;												\
+			table##_add(&shard->table, a->keys[i], a->hashes[i],		\
+						a->values[i]);									\
+			a->added++;													\
+		}																\
+		pthread_rwlock_unlock(&shard->lock);							\
+	}																	\
+	return NULL;														\
+}																		\
+																		\
+/* Run FN on each of the NTHREADS ARGS, on as many threads. */			\
+static inline void name##_build_run(struct name##_build_arg *args,		\
+									int nthreads,						\
+									void *(*fn)(void *))				\
+{																		\
+	pthread_t tids[CMAP_MAX_BUILD_THREADS];								\
+	int started[CMAP_MAX_BUILD_THREADS];								\
+	int t;																\
+																		\
+	for (t = 1; t < nthreads; t++)										\
+		started[t] = pthread_create(&tids[t], NULL, fn, &args[t]) == 0;	\
+	fn(&args[0]);														\
+	for (t = 1; t < nthreads; t++)										\
+		if (started[t])													\
+			pthread_join(tids[t], NULL);								\
+		else															\
+			fn(&args[t]);												\
+}																		\
+																		\
+/* Add the N keys KEYS with the values VALUES, on NTHREADS threads, or	\
+   one per core if NTHREADS is 0.  The keys are hashed and grouped by	\
+   shard in parallel, and then each thread fills whole shards of its	\
+   own, each table sized once for its keys.  Keys already in the map,	\
+   and repeats of a key within KEYS, are not added again.  Returns the	\
+   number of keys added, or -1 if out of memory. */						\
+static inline long name##_build(struct name *m,							\
+								const key_t *keys,						\
+								const value_t *values,					\
+								long n,									\
+								int nthreads)							\
+{																		\
+	struct name##_build_arg args[CMAP_MAX_BUILD_THREADS];				\
+	unsigned long *hashes;												\
+	long *order, *pos, *starts;											\
+	long added = 0, next;												\
+	int s, t;															\
+																		\
+	if (nthreads <= 0)													\
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);					\
+	if (nthreads > m->nshards)											\
+		nthreads = m->nshards;											\
+	if (nthreads > CMAP_MAX_BUILD_THREADS)								\
+		nthreads = CMAP_MAX_BUILD_THREADS;								\
+	if (nthreads < 1)													\
+		nthreads = 1;													\
+																		\
+	hashes = (unsigned long *)malloc((n + 1) * sizeof(unsigned long));	\
+	order = (long *)malloc((n + 1) * sizeof(long));						\
+	pos = (long *)calloc((long)nthreads * m->nshards, sizeof(long));	\
+	starts = (long *)malloc((m->nshards + 1) * sizeof(long));			\
+	if (hashes == NULL || order == NULL || pos == NULL || starts == NULL) \
+	{																	\
+		free(hashes);													\
+		free(order);													\
+		free(pos);														\
+		free(starts);													\
+		return -1;														\
+	}																	\
+																		\
+	for (t = 0; t < nthreads; t++)										\
+	{																	\
+		args[t].m = m;													\
+		args[t].keys = keys;											\
+		args[t].values = values;										\
+		args[t].hashes = hashes;										\
+		args[t].order = order;											\
+		args[t].pos = pos;												\
+		args[t].starts = starts;										\
+		args[t].begin = n / nthreads * t;								\
+		args[t].end = t == nthreads - 1 ? n : n / nthreads * (t + 1);	\
+		args[t].thread = t;												\
+		args[t].nthreads = nthreads;									\
+		args[t].added = 0;												\
+	}																	\
+																		\
+	name##_build_run(args, nthreads, name##_build_hash);				\
+																		\
+	/* Turn the counts into places: shard by shard, and within a shard	\
+	   thread by thread, so that the keys keep their order. */			\
+	for (s = 0, next = 0; s < m->nshards; s++)							\
+	{																	\
+		starts[s] = next;												\
+		for (t = 0; t < nthreads; t++)									\
+		{																\
+			long count = pos[(long)t * m->nshards + s];					\
+																		\
+			pos[(long)t * m->nshards + s] = next;						\
+			next += count;												\
+		}																\
+	}																	\
+	starts[m->nshards] = next;											\
+																		\
+	name##_build_run(args, nthreads, name##_build_scatter);				\
+	name##_build_run(args, nthreads, name##_build_insert);				\
+																		\
+	for (t = 0; t < nthreads; t++)										\
+		added += args[t].added;											\
+																		\
+	free(hashes);														\
+	free(order);														\
+	free(pos);															\
+	free(starts);														\
+																		\
+	return added;														\
+}
+
+#endif
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "utils.h"
+
+/* Timeouts are seconds long; looking for expired ones this often is
+   plenty. */
+#define CORO_TIMEOUT_SCAN 0.1
+
+#define CORO_MAX_EVENTS 256
+
+struct coro
+{
+	ucontext_t ctx;
+	char *stack;	/* mapping, guard page first */
+	size_t stack_size;
+
+	struct coro_sched *sched;
+	coro_fn fn;
+	void *arg;
+	int done;
+
+	/* while parked in coro_wait_fd, or in coro_park with FD -1 */
+	int fd;
+	double deadline;
+	int result;	/* 0 or an errno */
+
+	struct coro *next;	/* ready or free list */
+	struct coro *wait_prev, *wait_next;
+
+	/* on the scheduler's REMOTE list, pushed by coro_wake */
+	struct coro *remote_next;
+	int remote_queued;
+};
+
+struct coro_sched
+{
+	ucontext_t ctx;
+	int epfd;
+	int cancel_fd;
+	int cancelled;
+	size_t stack_size;
+	long page_size;
+
+	/* Other threads wake the scheduler through WAKE_FD, written only
+	   when WAKE_PENDING was clear, and hand it coroutines to make
+	   ready on REMOTE. */
+	int wake_fd;
+	int wake_pending;
+	struct coro *remote;
+
+	int alive;
+	struct coro *ready_head, *ready_tail;
+	struct coro *waiting;	/* doubly linked */
+	struct coro *free_list;
+	double next_scan;
+};
+
+static __thread struct coro_sched *current_sched;
+
+static __thread struct coro *current_coro;
+
+static void make_ready(struct coro_sched *s, struct coro *c)
+{
+	c->next = NULL;
+	if (s->ready_tail)
+		s->ready_tail->next = c;
+	else
+		s->ready_head = c;
+	s->ready_tail = c;
+}
+
+static void unlink_waiting(struct coro_sched *s, struct coro *c)
+{
+	if (c->wait_prev)
+		c->wait_prev->wait_next = c->wait_next;
+	else
+		s->waiting = c->wait_next;
+	if (c->wait_next)
+		c->wait_next->wait_prev = c->wait_prev;
+	c->wait_prev = c->wait_next = NULL;
+}
+
+/* Wake a parked coroutine with RESULT. */
+static void wake(struct coro_sched *s, struct coro *c, int result)
+{
+	if (c->fd >= 0)
+		epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	c->result = result;
+	unlink_waiting(s, c);
+	make_ready(s, c);
+}
+
+/* Every coroutine starts here and stays here: when its function
+   returns it goes back to the scheduler, which may later reuse it for
+   another function. */
+static void coro_main(void)
+{
+	for (;;)
+	{
+		struct coro *c = current_coro;
+
+		c->fn(c->arg);
+		c->done = 1;
+		swapcontext(&c->ctx, &current_sched->ctx);
+	}
+}
+
+struct coro_sched *coro_sched_new(int stack_size, int cancel_fd)
+{
+	struct coro_sched *s;
+	struct epoll_event ev;
+
+	s = (struct coro_sched *)calloc(1, sizeof(struct coro_sched));
+	if (s == NULL)
+		return NULL;
+
+	s->page_size = sysconf(_SC_PAGESIZE);
+	s->stack_size = (stack_size + s->page_size - 1) & ~(s->page_size - 1);
+	s->cancel_fd = cancel_fd;
+	s->next_scan = now_seconds() + CORO_TIMEOUT_SCAN;
+
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0)
+	{
+		perror("Can't create epoll instance");
+		free(s);
+		return NULL;
+	}
+
+	s->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (s->wake_fd < 0 || epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &ev) < 0)
+	{
+		perror("Can't create scheduler wakeup descriptor");
+		if (s->wake_fd >= 0)
+			close(s->wake_fd);
+		close(s->epfd);
+		free(s);
+		return NULL;
+	}
+
+	if (cancel_fd >= 0)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(s->epfd, EPOLL_CTL_ADD, cancel_fd, &ev);
+	}
+
+	return s;
+}
+
+/* Coroutines still alive are abandoned along with their stacks. */
+void coro_sched_delete(struct coro_sched *s)
+{
+	struct coro *c;
+
+	while ((c = s->free_list) != NULL)
+	{
+		s->free_list = c->next;
+		munmap(c->stack, c->stack_size + s->page_size);
+		free(c);
+	}
+
+	close(s->wake_fd);
+	close(s->epfd);
+	free(s);
+}
+
+/* Create a coroutine running FN(ARG); it starts on the next coro_run.
+   Must be called on the scheduler's thread, from outside or inside
+   one of its coroutines. */
+int coro_spawn(struct coro_sched *s, coro_fn fn, void *arg)
+{
+	struct coro *c = s->free_list;
+
+	if (c)
+		s->free_list = c->next;
+	else
+	{
+		c = (struct coro *)calloc(1, sizeof(struct coro));
+		if (c == NULL)
+			return -1;
+
+		c->sched = s;
+		c->stack_size = s->stack_size;
+		c->stack = mmap(NULL, c->stack_size + s->page_size,
+						PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (c->stack == MAP_FAILED)
+		{
+			perror("Can't map coroutine stack");
+			free(c);
+			return -1;
+		}
+		/* Overflowing the stack faults instead of corrupting the heap. */
+		mprotect(c->stack, s->page_size, PROT_NONE);
+
+		getcontext(&c->ctx);
+		c->ctx.uc_stack.ss_sp = c->stack + s->page_size;
+		c->ctx.uc_stack.ss_size = c->stack_size;
+		c->ctx.uc_link = NULL;
+		makecontext(&c->ctx, coro_main, 0);
+	}
+
+	c->fn = fn;
+	c->arg = arg;
+	c->done = 0;
+	s->alive++;
+	make_ready(s, c);
+
+	return 0;
+}
+
+static void run_ready(struct coro_sched *s)
+{
+	struct coro *c;
+
+	while ((c = s->ready_head) != NULL)
+	{
+		s->ready_head = c->next;
+		if (s->ready_head == NULL)
+			s->ready_tail = NULL;
+
+		current_coro = c;
+		swapcontext(&s->ctx, &c->ctx);
+		current_coro = NULL;
+
+		if (c->done)
+		{
+			s->alive--;
+			c->next = s->free_list;
+			s->free_list = c;
+		}
+	}
+}
+
+/* Make the coroutines other threads passed to coro_wake ready, if
+   they are still parked in coro_park. */
+static void take_remote(struct coro_sched *s)
+{
+	struct coro *c, *next;
+	uint64_t n;
+
+	if (read(s->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		perror("Can't read scheduler wakeup descriptor");
+
+	/* Wakeups from here on write the descriptor again. */
+	__atomic_store_n(&s->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+	for (c = __atomic_exchange_n(&s->remote, NULL, __ATOMIC_ACQ_REL); c;
+		 c = next)
+	{
+		next = c->remote_next;
+		__atomic_store_n(&c->remote_queued, 0, __ATOMIC_RELEASE);
+		if (c->fd < 0 && (c->wait_prev || s->waiting == c))
+			wake(s, c, 0);
+	}
+}
+
+/* Run the coroutines that can run, then wait up to TIMEOUT seconds
+   (forever if TIMEOUT is negative) for parked ones to become ready or
+   for coro_sched_wake, and run those.  Returns the number of
+   coroutines still alive. */
+int coro_run(struct coro_sched *s, double timeout)
+{
+	struct epoll_event events[CORO_MAX_EVENTS];
+	struct coro *c, *next;
+	double now;
+	int n, i;
+
+	current_sched = s;
+	run_ready(s);
+
+	if (s->alive == 0 && timeout == 0.0)
+		return 0;
+
+	/* Parked coroutines time out; look for those on time. */
+	if (s->ready_head)
+		timeout = 0.0;
+	else if (s->waiting)
+	{
+		double scan = s->next_scan - now_seconds();
+
+		if (scan < 0.0)
+			scan = 0.0;
+		if (timeout < 0.0 || timeout > scan)
+			timeout = scan;
+	}
+
+	n = epoll_wait(s->epfd, events, CORO_MAX_EVENTS,
+				   timeout < 0.0 ? -1 : (int)ceil(timeout * 1000));
+
+	for (i = 0; i < n; i++)
+	{
+		c = (struct coro *)events[i].data.ptr;
+
+		if (events[i].data.ptr == s)
+			take_remote(s);
+		else if (c == NULL)
+		{
+			/* Cancelled: everybody waiting gives up, and so does
+			   anybody who tries to wait later. */
+			s->cancelled = 1;
+			epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->cancel_fd, NULL);
+			while (s->waiting)
+				wake(s, s->waiting, ECANCELED);
+		}
+		else if (c->wait_prev || s->waiting == c)
+			wake(s, c, 0);
+	}
+
+	now = now_seconds();
+	if (now >= s->next_scan)
+	{
+		for (c = s->waiting; c; c = next)
+		{
+			next = c->wait_next;
+			if (c->deadline <= now)
+				wake(s, c, ETIMEDOUT);
+		}
+		s->next_scan = now + CORO_TIMEOUT_SCAN;
+	}
+
+	run_ready(s);
+	current_sched = NULL;
+
+	return s->alive;
+}
+
+int coro_count(struct coro_sched *s)
+{
+	return s->alive;
+}
+
+/* Whether the caller is a coroutine. */
+int coro_running(void)
+{
+	return current_coro != NULL;
+}
+
+/* The calling coroutine, for coro_wake; NULL outside coroutines. */
+struct coro *coro_self(void)
+{
+	return current_coro;
+}
+
+/* Wake the scheduler S out of coro_run.  Any thread may call this. */
+void coro_sched_wake(struct coro_sched *s)
+{
+	uint64_t one = 1;
+
+	if (!__atomic_exchange_n(&s->wake_pending, 1, __ATOMIC_SEQ_CST) &&
+		write(s->wake_fd, &one, sizeof(one)) < 0)
+		perror("Can't wake coroutine scheduler");
+}
+
+/* Make C ready again if it is parked in coro_park.  Any thread may
+   call this, also once C has stopped waiting: the wakeup is then
+   spurious, so coro_park callers check what they wait for again. */
+void coro_wake(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+
+	if (!__atomic_exchange_n(&c->remote_queued, 1, __ATOMIC_ACQ_REL))
+	{
+		c->remote_next = __atomic_load_n(&s->remote, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&s->remote, &c->remote_next, c,
+											1, __ATOMIC_RELEASE,
+											__ATOMIC_RELAXED))
+			;
+	}
+	coro_sched_wake(s);
+}
+
+/* Park C, registered with epoll for FD or with FD -1, until it is
+   woken or TIMEOUT seconds (forever if negative) pass. */
+static int park(struct coro_sched *s, struct coro *c, int fd, double timeout)
+{
+	c->fd = fd;
+	c->deadline = timeout < 0.0 ? HUGE_VAL : now_seconds() + timeout;
+	c->wait_prev = NULL;
+	c->wait_next = s->waiting;
+	if (s->waiting)
+		s->waiting->wait_prev = c;
+	s->waiting = c;
+
+	swapcontext(&c->ctx, &s->ctx);
+
+	if (c->result)
+	{
+		errno = c->result;
+		return -1;
+	}
+	return 0;
+}
+
+/* Park the calling coroutine until FD has one of EVENTS (POLLIN or
+   POLLOUT), for at most TIMEOUT seconds.  Returns 0 when it does, or
+   -1 with errno ETIMEDOUT or ECANCELED. */
+int coro_wait_fd(int fd, short events, double timeout)
+{
+	struct coro_sched *s = current_sched;
+	struct coro *c = current_coro;
+	struct epoll_event ev;
+
+	if (s->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	ev.events = EPOLLONESHOT | EPOLLERR | EPOLLHUP |
+		((events & POLLIN) ? EPOLLIN : 0) |
+		((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	return park(s, c, fd, timeout);
+}
+
+/* Park the calling coroutine until another thread passes it to
+   coro_wake, for at most TIMEOUT seconds (forever if negative).
+   Returns 0 when woken, or -1 with errno ETIMEDOUT or ECANCELED. */
+int coro_park(double timeout)
+{
+	struct coro_sched *s = current_sched;
+
+	if (s->cancelled)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+
+	return park(s, current_coro, -1, timeout);
+}
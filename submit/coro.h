@@ -0,0 +1,52 @@
+#ifndef _CORO_H
+#define _CORO_H
+
+/*
+ * Coroutines for I/O-bound tasks.
+ *
+ * A scheduler belongs to the thread that created it and runs any
+ * number of coroutines on it, each on a small stack of its own.  A
+ * coroutine that would block on a socket calls coro_wait_fd instead,
+ * which parks it until the socket is ready (through epoll), its
+ * timeout expires or the scheduler's cancel descriptor becomes
+ * readable, and meanwhile runs the others.  Code running in a
+ * coroutine therefore reads as plain blocking code.
+ *
+ * Coroutines must not block the thread in other ways for long: a
+ * mutex or condition variable wait holds up every coroutine of the
+ * scheduler.  To wait for another thread instead, a coroutine parks
+ * with coro_park and that thread wakes it with coro_wake.  Other
+ * threads can also wake the scheduler itself out of coro_run with
+ * coro_sched_wake, e.g. when there is new work to spawn coroutines
+ * for.
+ */
+
+struct coro_sched;
+
+struct coro;
+
+typedef void (*coro_fn)(void *arg);
+
+extern struct coro_sched *coro_sched_new(int stack_size, int cancel_fd);
+
+extern void coro_sched_delete(struct coro_sched *s);
+
+extern int coro_spawn(struct coro_sched *s, coro_fn fn, void *arg);
+
+extern int coro_run(struct coro_sched *s, double timeout);
+
+extern int coro_count(struct coro_sched *s);
+
+extern int coro_running(void);
+
+extern int coro_wait_fd(int fd, short events, double timeout);
+
+extern int coro_park(double timeout);
+
+extern struct coro *coro_self(void);
+
+extern void coro_wake(struct coro *c);
+
+extern void coro_sched_wake(struct coro_sched *s);
+
+#endif
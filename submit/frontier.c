@@ -0,0 +1,913 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "frontier.h"
+#include "url.h"
+#include "hash.h"
+#include "utils.h"
+#include "checkpoint.h"
+
+/* Per-page state, indexed by node id in lazily allocated chunks so
+   that it can grow without moving under concurrent readers. */
+#define STATE_CHUNK_BITS 16
+#define STATE_CHUNK_SIZE (1L << STATE_CHUNK_BITS)
+#define STATE_MAX_CHUNKS 65536
+
+#define STATE_QUEUED  0x80
+#define STATE_DONE    0x40	/* handed out of the front queues */
+#define STATE_FETCHED 0x20	/* released by its worker */
+#define STATE_LEVEL   0x1f
+
+#define DEPTH_MAX 255
+
+/* URLs moved into the back queues per back queue, at most.  Keeps the
+   bulk of the frontier in the (spillable) front queues when a few
+   hosts hold most of the links. */
+#define BACK_QUEUE_DEPTH 64
+
+struct page_state
+{
+	unsigned char flags;	/* STATE_* bits and current level */
+	unsigned char depth;
+};
+
+struct back_entry
+{
+	struct url_entry e;
+	struct back_entry *next;
+};
+
+/* A back queue holds the URLs of one host.  It sits in the readiness
+   heap while it has URLs and a free connection slot. */
+struct back_queue
+{
+	char *host;		/* NULL while unassigned */
+	struct back_entry *head;
+	struct back_entry *tail;
+	int inflight;
+	int heap_pos;	/* -1 when not in the heap */
+	double next_time;
+};
+
+struct frontier
+{
+	/* front queues, by priority */
+	struct url_queue *levels[FRONTIER_LEVELS];
+	struct page_state **chunks;
+	char *spill_dir;
+	struct spill_service *spill_service;	/* their disk I/O */
+
+	int count;	/* live entries, stale copies excluded */
+
+	/* Termination: pages queued or being fetched.  A page is counted
+	   from its push to its release, and its links are pushed before
+	   it is released, so this reaches zero only when the crawl is
+	   over.  The release that brings it there sets DONE. */
+	long in_flight;
+	int done;
+	int stopped;	/* frontier_stop: hand out nothing more */
+
+	/* back queues, by host; everything below is under back_lock */
+	struct back_queue *back;
+	int nback;
+	int *free_back;
+	int nfree;
+	int *heap;
+	int heap_size;
+	struct hash_table *host_map;
+	long back_count;
+
+	int max_per_host;
+	double delay_factor;
+
+	frontier_url_fn url_of;
+	void *url_arg;
+
+	/* Told whenever pages may have become ready or the crawl ended,
+	   for poppers that do not wait on back_cond. */
+	frontier_wake_fn wake;
+	void *wake_arg;
+
+	pthread_mutex_t back_lock;
+	pthread_cond_t back_cond;
+	int waiters;
+};
+
+static struct page_state *page_state(struct frontier *f, long id)
+{
+	long chunk = id >> STATE_CHUNK_BITS;
+	struct page_state *c;
+
+	if (id < 0 || chunk >= STATE_MAX_CHUNKS)
+		return NULL;
+
+	c = __atomic_load_n(&f->chunks[chunk], __ATOMIC_ACQUIRE);
+	if (c == NULL)
+	{
+		struct page_state *expected = NULL;
+
+		c = (struct page_state *)
+			calloc(STATE_CHUNK_SIZE, sizeof(struct page_state));
+		if (c == NULL)
+			return NULL;
+		if (!__atomic_compare_exchange_n(&f->chunks[chunk], &expected, c, 0,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			free(c);
+			c = expected;
+		}
+	}
+
+	return &c[id & (STATE_CHUNK_SIZE - 1)];
+}
+
+static void wake_waiters(struct frontier *f);
+
+static void spill_ready(void *arg)
+{
+	wake_waiters((struct frontier *)arg);
+}
+
+static int level_of(long in_degree)
+{
+	int level = 0;
+
+	while (in_degree > 1 && level < FRONTIER_LEVELS - 1)
+	{
+		in_degree >>= 1;
+		level++;
+	}
+	return level;
+}
+
+struct frontier *frontier_new(long capacity,
+							  const char *spill_dir,
+							  int back_queues)
+{
+	struct frontier *f;
+	pthread_condattr_t attr;
+	int i;
+
+	f = (struct frontier *)calloc(1, sizeof(struct frontier));
+	if (f == NULL)
+		return NULL;
+
+	if (back_queues < 1)
+		back_queues = 1;
+
+	f->nback = back_queues;
+	f->back = (struct back_queue *)
+		calloc(back_queues, sizeof(struct back_queue));
+	f->free_back = (int *)malloc(back_queues * sizeof(int));
+	f->heap = (int *)malloc(back_queues * sizeof(int));
+	f->host_map = make_string_hash_table(back_queues);
+	f->chunks = (struct page_state **)
+		calloc(STATE_MAX_CHUNKS, sizeof(struct page_state *));
+	if (f->back == NULL || f->free_back == NULL || f->heap == NULL ||
+		f->host_map == NULL || f->chunks == NULL)
+	{
+		free(f->back);
+		free(f->free_back);
+		free(f->heap);
+		if (f->host_map)
+			hash_table_destroy(f->host_map);
+		free(f->chunks);
+		free(f);
+		return NULL;
+	}
+
+	for (i = 0; i < back_queues; i++)
+	{
+		f->back[i].heap_pos = -1;
+		f->free_back[i] = back_queues - 1 - i;
+	}
+	f->nfree = back_queues;
+
+	f->max_per_host = 1;
+	f->delay_factor = 0.0;
+
+	pthread_mutex_init(&f->back_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&f->back_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (spill_dir)
+	{
+		if (mkdir(spill_dir, 0755) != 0 && errno != EEXIST)
+			perror("Can't create frontier spill directory");
+		else
+			f->spill_dir = strdup(spill_dir);
+	}
+
+	/* A front queue whose next pages are on disk is skipped until
+	   they have been read back; then the poppers try again. */
+	if (f->spill_dir)
+		f->spill_service = spill_service_new(spill_ready, f);
+
+	for (i = 0; i < FRONTIER_LEVELS; i++)
+	{
+		char path[4096];
+		long cap = i == 0 ? capacity : capacity >> 3;
+
+		snprintf(path, sizeof(path), "%s/level-%02d",
+				 f->spill_dir ? f->spill_dir : "", i);
+
+		f->levels[i] = url_queue_new(cap, f->spill_dir ? path : NULL,
+									 f->spill_service);
+		if (f->levels[i] == NULL)
+		{
+			frontier_delete(f);
+			return NULL;
+		}
+	}
+
+	return f;
+}
+
+void frontier_delete(struct frontier *f)
+{
+	long i;
+
+	for (i = 0; i < f->nback; i++)
+	{
+		struct back_entry *e = f->back[i].head;
+
+		while (e)
+		{
+			struct back_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+		free(f->back[i].host);
+	}
+	free(f->back);
+	free(f->free_back);
+	free(f->heap);
+	hash_table_destroy(f->host_map);
+
+	/* The spill thread may still wake poppers until it is gone. */
+	for (i = 0; i < FRONTIER_LEVELS; i++)
+		if (f->levels[i])
+			url_queue_delete(f->levels[i]);
+	if (f->spill_service)
+		spill_service_delete(f->spill_service);
+
+	pthread_cond_destroy(&f->back_cond);
+	pthread_mutex_destroy(&f->back_lock);
+
+	for (i = 0; i < STATE_MAX_CHUNKS; i++)
+		free(f->chunks[i]);
+	free(f->chunks);
+
+	if (f->spill_dir)
+	{
+		rmdir(f->spill_dir);
+		free(f->spill_dir);
+	}
+
+	free(f);
+}
+
+/* Queue one page without waking anyone; returns 1 if it was queued. */
+static int push_one(struct frontier *f, long id, long referer, int depth)
+{
+	struct page_state *ps = page_state(f, id);
+	struct url_entry e;
+	unsigned char old, new;
+
+	e.id = id;
+	e.referer = referer;
+	e.depth = depth;
+	e.priority = 0;
+
+	if (ps == NULL)
+	{
+		__atomic_add_fetch(&f->in_flight, 1, __ATOMIC_ACQ_REL);
+		__atomic_add_fetch(&f->count, 1, __ATOMIC_RELAXED);
+		url_enqueue(f->levels[0], &e);
+		return 1;
+	}
+
+	__atomic_store_n(&ps->depth, depth > DEPTH_MAX ? DEPTH_MAX : depth,
+					 __ATOMIC_RELAXED);
+
+	old = __atomic_load_n(&ps->flags, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (old & (STATE_QUEUED | STATE_DONE))
+			return 0;
+		new = old | STATE_QUEUED;
+	}
+	while (!__atomic_compare_exchange_n(&ps->flags, &old, new, 1,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	e.priority = old & STATE_LEVEL;
+	__atomic_add_fetch(&f->in_flight, 1, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&f->count, 1, __ATOMIC_RELAXED);
+	url_enqueue(f->levels[e.priority], &e);
+	return 1;
+}
+
+/* Queue the page with node id ID, found on page REFERER (-1 if none).
+   A page that is already queued or was already handed out is
+   dropped. */
+void frontier_push(struct frontier *f, long id, long referer, int depth)
+{
+	if (push_one(f, id, referer, depth))
+		wake_waiters(f);
+}
+
+/* Queue the N pages IDS[i], all found on page REFERER, and wake
+   waiting workers once. */
+void frontier_push_batch(struct frontier *f,
+						 const long *ids,
+						 int n,
+						 long referer,
+						 int depth)
+{
+	int queued = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		queued += push_one(f, ids[i], referer, depth);
+
+	if (queued)
+		wake_waiters(f);
+}
+
+/* Take the oldest page of the highest front queue that has one in
+   memory. */
+static int front_pop(struct frontier *f, struct url_entry *e)
+{
+	int level;
+
+	for (level = FRONTIER_LEVELS - 1; level >= 0; level--)
+	{
+		struct url_queue *q = f->levels[level];
+
+		if (url_get_queue_count(q) == 0)
+			continue;
+
+		while (url_dequeue(q, e))
+		{
+			struct page_state *ps = page_state(f, e->id);
+			unsigned char old;
+
+			if (ps == NULL)
+				return 1;
+
+			old = __atomic_load_n(&ps->flags, __ATOMIC_ACQUIRE);
+			while ((old & STATE_QUEUED) && !(old & STATE_DONE) &&
+				   (old & STATE_LEVEL) == level)
+			{
+				if (__atomic_compare_exchange_n(&ps->flags, &old,
+							old | STATE_DONE, 1,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+					return 1;
+			}
+
+			/* Stale: the page moved to a higher level. */
+		}
+	}
+
+	return 0;
+}
+
+/* Host part of URL, with the port, used to pick its back queue. */
+static void host_of(const char *url, char *buf, int size)
+{
+	const char *b = strstr(url, "://");
+	const char *e;
+	int len;
+
+	b = b ? b + 3 : url;
+	e = strpbrk_or_eos(b, "/?#");
+	len = MIN(e - b, size - 1);
+	memcpy(buf, b, len);
+	buf[len] = '\0';
+}
+
+/*
+ * Readiness heap: a binary min-heap of back queue indices keyed on the
+ * time each host may be contacted again.
+ */
+
+#define HEAP_KEY(f, i) ((f)->back[(f)->heap[i]].next_time)
+
+static void heap_swap(struct frontier *f, int i, int j)
+{
+	int t = f->heap[i];
+	f->heap[i] = f->heap[j];
+	f->heap[j] = t;
+	f->back[f->heap[i]].heap_pos = i;
+	f->back[f->heap[j]].heap_pos = j;
+}
+
+static void heap_sift(struct frontier *f, int i)
+{
+	while (i > 0 && HEAP_KEY(f, i) < HEAP_KEY(f, (i - 1) / 2))
+	{
+		heap_swap(f, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for (;;)
+	{
+		int l = 2 * i + 1, r = l + 1, m = i;
+
+		if (l < f->heap_size && HEAP_KEY(f, l) < HEAP_KEY(f, m))
+			m = l;
+		if (r < f->heap_size && HEAP_KEY(f, r) < HEAP_KEY(f, m))
+			m = r;
+		if (m == i)
+			break;
+		heap_swap(f, i, m);
+		i = m;
+	}
+}
+
+static void heap_remove(struct frontier *f, int i)
+{
+	int last = --f->heap_size;
+
+	f->back[f->heap[i]].heap_pos = -1;
+	if (i != last)
+	{
+		f->heap[i] = f->heap[last];
+		f->back[f->heap[i]].heap_pos = i;
+		heap_sift(f, i);
+	}
+}
+
+/* Put back queue Q in or out of the heap according to whether it can
+   serve a URL, and restore the heap order after a key change. */
+static void back_update(struct frontier *f, int q)
+{
+	struct back_queue *bq = &f->back[q];
+	int eligible = bq->head != NULL && bq->inflight < f->max_per_host;
+
+	if (eligible && bq->heap_pos < 0)
+	{
+		bq->heap_pos = f->heap_size;
+		f->heap[f->heap_size++] = q;
+		heap_sift(f, bq->heap_pos);
+	}
+	else if (eligible)
+		heap_sift(f, bq->heap_pos);
+	else if (bq->heap_pos >= 0)
+		heap_remove(f, bq->heap_pos);
+}
+
+static void back_append(struct frontier *f, int q,
+						const struct url_entry *entry)
+{
+	struct back_queue *bq = &f->back[q];
+	struct back_entry *e;
+
+	e = (struct back_entry *)malloc(sizeof(struct back_entry));
+	e->e = *entry;
+	e->next = NULL;
+
+	if (bq->tail)
+		bq->tail->next = e;
+	else
+		bq->head = e;
+	bq->tail = e;
+
+	++f->back_count;
+	back_update(f, q);
+}
+
+/* Mercator refill: while some back queue is unassigned, move URLs from
+   the front queues to the back queue of their host, claiming a free
+   back queue for the first URL of a new host. */
+static void back_refill(struct frontier *f)
+{
+	struct url_entry e;
+
+	while (f->nfree > 0 &&
+		   f->back_count < (long)f->nback * BACK_QUEUE_DEPTH &&
+		   front_pop(f, &e))
+	{
+		char host[256];
+		char *url;
+		void *slot;
+		int q;
+
+		/* Without a URL source every page counts as the same host. */
+		url = f->url_of ? f->url_of(f->url_arg, e.id) : NULL;
+		host_of(url ? url : "", host, sizeof(host));
+		free(url);
+
+		if (hash_table_get_pair(f->host_map, host, NULL, &slot))
+			q = (int)(intptr_t)slot - 1;
+		else
+		{
+			q = f->free_back[--f->nfree];
+			f->back[q].host = strdup(host);
+			f->back[q].next_time = 0.0;
+			hash_table_put(f->host_map, f->back[q].host,
+						   (void *)(intptr_t)(q + 1));
+		}
+
+		back_append(f, q, &e);
+	}
+}
+
+static void notify(struct frontier *f)
+{
+	if (f->wake)
+		f->wake(f->wake_arg);
+}
+
+static void wake_waiters(struct frontier *f)
+{
+	notify(f);
+	if (__atomic_load_n(&f->waiters, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&f->back_lock);
+	pthread_cond_broadcast(&f->back_cond);
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/* Set DONE if nothing is queued or being fetched, e.g. in a resumed
+   crawl that had finished.  Called with back_lock held. */
+static int check_done(struct frontier *f)
+{
+	if (!f->done && __atomic_load_n(&f->in_flight, __ATOMIC_ACQUIRE) == 0)
+	{
+		f->done = 1;
+		pthread_cond_broadcast(&f->back_cond);
+		notify(f);
+	}
+	return f->done || f->stopped;
+}
+
+/* Take a page whose host may be contacted now.  Otherwise return 0
+   and set *NEXT to when the earliest host will be ready, or to -1 if
+   no host has pages.  Called with back_lock held. */
+static int pop_ready(struct frontier *f, struct url_entry *entry, int *host,
+					 double *next)
+{
+	struct back_queue *bq;
+	struct back_entry *e;
+	int q;
+
+	back_refill(f);
+
+	if (f->heap_size == 0)
+	{
+		*next = -1.0;
+		return 0;
+	}
+
+	q = f->heap[0];
+	bq = &f->back[q];
+	if (bq->next_time > now_seconds())
+	{
+		*next = bq->next_time;
+		return 0;
+	}
+
+	e = bq->head;
+	bq->head = e->next;
+	if (bq->head == NULL)
+		bq->tail = NULL;
+	--f->back_count;
+	++bq->inflight;
+	back_update(f, q);
+
+	*entry = e->e;
+	*host = q;
+	free(e);
+
+	__atomic_sub_fetch(&f->count, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Hand out a page whose host may be contacted right now.  If every
+   host with pending pages is busy or inside its politeness delay, wait
+   until the earliest one is ready; if nothing is queued but pages are
+   still being fetched, wait for what they link to.  Returns 0 once
+   the crawl is over.  *HOST identifies the host for frontier_release. */
+int frontier_pop(struct frontier *f, struct url_entry *entry, int *host)
+{
+	int ret = 0;
+	double next;
+
+	pthread_mutex_lock(&f->back_lock);
+	__atomic_add_fetch(&f->waiters, 1, __ATOMIC_RELEASE);
+
+	while (!check_done(f))
+	{
+		if (pop_ready(f, entry, host, &next))
+		{
+			ret = 1;
+			break;
+		}
+
+		if (next >= 0.0)
+		{
+			struct timespec ts;
+
+			ts.tv_sec = (time_t)next;
+			ts.tv_nsec = (long)((next - ts.tv_sec) * 1e9);
+			pthread_cond_timedwait(&f->back_cond, &f->back_lock, &ts);
+		}
+		else
+			pthread_cond_wait(&f->back_cond, &f->back_lock);
+	}
+
+	__atomic_sub_fetch(&f->waiters, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&f->back_lock);
+
+	return ret;
+}
+
+/* frontier_pop for callers that must not block.  Returns 1 with a
+   page, -1 once the crawl is over, or 0 if no page is ready yet; then
+   *WAIT is the number of seconds until one may be, or -1 if that
+   depends on pages still being fetched. */
+int frontier_try_pop(struct frontier *f, struct url_entry *entry, int *host,
+					 double *wait)
+{
+	int ret;
+	double next;
+
+	pthread_mutex_lock(&f->back_lock);
+
+	if (check_done(f))
+		ret = -1;
+	else if ((ret = pop_ready(f, entry, host, &next)) == 0)
+		*wait = next >= 0.0 ? next - now_seconds() : -1.0;
+
+	pthread_mutex_unlock(&f->back_lock);
+
+	return ret;
+}
+
+void frontier_release(struct frontier *f, int host, long id, double elapsed)
+{
+	struct back_queue *bq = &f->back[host];
+	struct page_state *ps = page_state(f, id);
+	double next;
+
+	if (ps)
+		__atomic_or_fetch(&ps->flags, STATE_FETCHED, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&f->back_lock);
+
+	--bq->inflight;
+	if (__atomic_sub_fetch(&f->in_flight, 1, __ATOMIC_ACQ_REL) == 0)
+		f->done = 1;
+	next = now_seconds() + f->delay_factor * elapsed;
+	if (next > bq->next_time)
+		bq->next_time = next;
+
+	if (bq->head == NULL && bq->inflight == 0)
+	{
+		hash_table_remove(f->host_map, bq->host);
+		free(bq->host);
+		bq->host = NULL;
+		f->free_back[f->nfree++] = host;
+	}
+	else
+		back_update(f, host);
+
+	pthread_cond_broadcast(&f->back_cond);
+	notify(f);
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/*
+ * Checkpoints save the page states only: a page that was queued but
+ * not released is pending and is queued again on restore, at its
+ * level, in id (that is, discovery) order.  Pages that were handed
+ * out but not released are fetched again.
+ */
+struct frontier_checkpoint
+{
+	struct page_state *states;
+	long n;
+};
+
+/* Copy the page states; takes no lock. */
+struct frontier_checkpoint *frontier_checkpoint_begin(struct frontier *f)
+{
+	struct frontier_checkpoint *cp;
+	long chunks, i, j;
+
+	for (chunks = STATE_MAX_CHUNKS; chunks > 0; chunks--)
+		if (__atomic_load_n(&f->chunks[chunks - 1], __ATOMIC_ACQUIRE))
+			break;
+
+	cp = (struct frontier_checkpoint *)
+		malloc(sizeof(struct frontier_checkpoint));
+	cp->n = chunks * STATE_CHUNK_SIZE;
+	cp->states = (struct page_state *)
+		calloc(cp->n + 1, sizeof(struct page_state));
+
+	for (i = 0; i < chunks; i++)
+	{
+		struct page_state *c = __atomic_load_n(&f->chunks[i],
+											   __ATOMIC_ACQUIRE);
+		struct page_state *out = cp->states + i * STATE_CHUNK_SIZE;
+
+		if (c == NULL)
+			continue;
+		for (j = 0; j < STATE_CHUNK_SIZE; j++)
+		{
+			out[j].flags = __atomic_load_n(&c[j].flags, __ATOMIC_ACQUIRE);
+			out[j].depth = __atomic_load_n(&c[j].depth, __ATOMIC_RELAXED);
+		}
+	}
+
+	return cp;
+}
+
+/* Write the states captured in CP as the state file of generation
+   M->generation.  CP is freed. */
+int frontier_checkpoint_write(struct frontier *f,
+							  struct frontier_checkpoint *cp,
+							  const char *dir,
+							  struct checkpoint_manifest *m)
+{
+	char name[64];
+	int ret;
+
+	checkpoint_state_name(m->generation, name, sizeof(name));
+	ret = checkpoint_replace(dir, name, cp->states,
+							 cp->n * sizeof(struct page_state));
+	if (ret == 0)
+		m->states = cp->n;
+
+	free(cp->states);
+	free(cp);
+
+	return ret;
+}
+
+/* Reload the page states of checkpoint M into an empty frontier and
+   queue the pending pages.  Pages past M->nodes are not in the saved
+   graph and are ignored. */
+int frontier_restore(struct frontier *f,
+					 const char *dir,
+					 const struct checkpoint_manifest *m)
+{
+	const struct page_state *states;
+	size_t len = m->states * sizeof(struct page_state);
+	char name[64];
+	uint64_t id, n;
+
+	n = m->states < m->nodes ? m->states : m->nodes;
+	if (n == 0)
+		return 0;
+
+	checkpoint_state_name(m->generation, name, sizeof(name));
+	states = (const struct page_state *)checkpoint_map(dir, name, len);
+	if (states == NULL)
+		return -1;
+
+	for (id = 0; id < n; id++)
+	{
+		unsigned char flags = states[id].flags;
+		struct page_state *ps;
+		struct url_entry e;
+
+		if (!(flags & STATE_QUEUED) || (ps = page_state(f, id)) == NULL)
+			continue;
+
+		ps->depth = states[id].depth;
+
+		if (flags & STATE_FETCHED)
+		{
+			ps->flags = flags;
+			continue;
+		}
+
+		ps->flags = STATE_QUEUED | (flags & STATE_LEVEL);
+
+		e.id = id;
+		e.referer = -1;
+		e.depth = states[id].depth;
+		e.priority = flags & STATE_LEVEL;
+		url_enqueue(f->levels[e.priority], &e);
+		++f->count;
+		++f->in_flight;
+	}
+
+	checkpoint_unmap((void *)states, len);
+	return 0;
+}
+
+/* FN maps a node id to a freshly allocated copy of its URL.  The
+   frontier only uses it to find the host of a page. */
+void frontier_set_url_source(struct frontier *f,
+							 frontier_url_fn fn,
+							 void *arg)
+{
+	pthread_mutex_lock(&f->back_lock);
+	f->url_of = fn;
+	f->url_arg = arg;
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/* FN is called, possibly with locks held, whenever frontier_try_pop
+   may have a page where it had none or the crawl is over; it must
+   only signal whoever calls it.  Set it before the crawl starts. */
+void frontier_set_wake_hook(struct frontier *f,
+							frontier_wake_fn fn,
+							void *arg)
+{
+	pthread_mutex_lock(&f->back_lock);
+	f->wake = fn;
+	f->wake_arg = arg;
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/* At most MAX_PER_HOST concurrent fetches per host, and after each one
+   the host rests for DELAY_FACTOR times the fetch's duration. */
+void frontier_set_politeness(struct frontier *f,
+							 int max_per_host,
+							 double delay_factor)
+{
+	pthread_mutex_lock(&f->back_lock);
+	f->max_per_host = max_per_host > 0 ? max_per_host : 1;
+	f->delay_factor = delay_factor >= 0.0 ? delay_factor : 0.0;
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/* Make every frontier_pop, waiting or to come, return 0 although
+   pages remain; the crawl is being stopped. */
+void frontier_stop(struct frontier *f)
+{
+	pthread_mutex_lock(&f->back_lock);
+	f->stopped = 1;
+	pthread_cond_broadcast(&f->back_cond);
+	notify(f);
+	pthread_mutex_unlock(&f->back_lock);
+}
+
+/* Whether the crawl ran out of pages, as opposed to being stopped. */
+int frontier_finished(struct frontier *f)
+{
+	int done;
+
+	pthread_mutex_lock(&f->back_lock);
+	done = f->done;
+	pthread_mutex_unlock(&f->back_lock);
+
+	return done;
+}
+
+int frontier_count(struct frontier *f)
+{
+	return __atomic_load_n(&f->count, __ATOMIC_RELAXED);
+}
+
+/* Raise the level of page ID to match its new in-degree.  If it is
+   waiting in the frontier, queue it again at the new level. */
+void frontier_link_hook(void *arg,
+						long id,
+						const char *url,
+						long in_degree)
+{
+	struct frontier *f = (struct frontier *)arg;
+	struct page_state *ps = page_state(f, id);
+	int level = level_of(in_degree);
+	unsigned char old, new;
+
+	if (ps == NULL)
+		return;
+
+	old = __atomic_load_n(&ps->flags, __ATOMIC_ACQUIRE);
+	do
+	{
+		if ((old & STATE_LEVEL) >= level)
+			return;
+		new = (old & ~STATE_LEVEL) | level;
+	}
+	while (!__atomic_compare_exchange_n(&ps->flags, &old, new, 1,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if ((old & STATE_QUEUED) && !(old & STATE_DONE))
+	{
+		struct url_entry e;
+
+		e.id = id;
+		e.referer = -1;
+		e.depth = __atomic_load_n(&ps->depth, __ATOMIC_RELAXED);
+		e.priority = level;
+		url_enqueue(f->levels[level], &e);
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef _FRONTIER_H
+#define _FRONTIER_H
+
+/*
+ * Two-level (Mercator-style) frontier.
+ *
+ * Front queues order URLs by priority: there are FRONTIER_LEVELS FIFO
+ * buckets, a page whose partial in-degree is d sits in bucket
+ * floor(log2(d)), and the highest non-empty bucket is served first.
+ * Priorities are raised through frontier_link_hook, which is meant to
+ * be installed with webgraph_set_link_hook.  When a queued page moves
+ * up, a copy is queued in the higher bucket and the old entry is
+ * skipped once it reaches the front of its bucket.
+ *
+ * Entries are fixed-size records keyed by web graph node id; the URL
+ * is only looked up, through the source set with
+ * frontier_set_url_source, when a page is routed to its host and when
+ * it is fetched.
+ *
+ * Back queues partition URLs by host.  Each back queue holds one host
+ * at a time and is refilled from the front queues as it drains.  A
+ * heap keyed on each host's next allowed fetch time decides which
+ * host frontier_pop serves, so a burst of links from one host can not
+ * starve the others and workers do not pile up on one server.
+ */
+
+#include "url.h"
+#include "checkpoint.h"
+
+#define FRONTIER_LEVELS 16
+
+struct frontier;
+
+struct frontier_checkpoint;
+
+/* Returns a malloc'ed copy of the URL of page ID, or NULL. */
+typedef char *(*frontier_url_fn)(void *arg, long id);
+
+typedef void (*frontier_wake_fn)(void *arg);
+
+extern struct frontier *frontier_new(long capacity,
+									 const char *spill_dir,
+									 int back_queues);
+
+extern void frontier_delete(struct frontier *f);
+
+extern void frontier_push(struct frontier *f,
+						  long id,
+						  long referer,
+						  int depth);
+
+extern void frontier_push_batch(struct frontier *f,
+								const long *ids,
+								int n,
+								long referer,
+								int depth);
+
+extern int frontier_pop(struct frontier *f,
+						struct url_entry *entry,
+						int *host);
+
+extern int frontier_try_pop(struct frontier *f,
+							struct url_entry *entry,
+							int *host,
+							double *wait);
+
+extern void frontier_release(struct frontier *f,
+							 int host,
+							 long id,
+							 double elapsed);
+
+extern void frontier_set_url_source(struct frontier *f,
+									frontier_url_fn fn,
+									void *arg);
+
+extern void frontier_set_wake_hook(struct frontier *f,
+								   frontier_wake_fn fn,
+								   void *arg);
+
+extern void frontier_set_politeness(struct frontier *f,
+									int max_per_host,
+									double delay_factor);
+
+extern int frontier_count(struct frontier *f);
+
+extern void frontier_stop(struct frontier *f);
+
+extern int frontier_finished(struct frontier *f);
+
+extern struct frontier_checkpoint *
+frontier_checkpoint_begin(struct frontier *f);
+
+extern int frontier_checkpoint_write(struct frontier *f,
+									 struct frontier_checkpoint *cp,
+									 const char *dir,
+									 struct checkpoint_manifest *m);
+
+extern int frontier_restore(struct frontier *f,
+							const char *dir,
+							const struct checkpoint_manifest *m);
+
+extern void frontier_link_hook(void *arg,
+							   long id,
+							   const char *url,
+							   long in_degree);
+
+#endif
@@ -65,6 +65,8 @@ as that of the covered work.  */
 #endif
 
 #include "hash.h"
+#include "htable.h"
+
 
 /* INTERFACE:
 
@@ -87,6 +89,8 @@ as that of the covered work.  */
      hash_table_iter_next -- return next element during iteration.
      hash_table_clear     -- clear hash table contents.
      hash_table_count     -- return the number of entries in the table.
+     hash_table_reserve   -- make room for a number of entries.
+     hash_table_rehash    -- rebuild the table for a number of entries.
 
    The hash table grows internally as new entries are added and is not
    limited in size, except by available memory.  The table doubles
@@ -112,44 +116,65 @@ as that of the covered work.  */
 
 /* IMPLEMENTATION:
 
-   The hash table is implemented as an open-addressed table with
-   linear probing collision resolution.
-
-   The above means that all the cells (each cell containing a key and
-   a value pointer) are stored in a contiguous array.  Array position
-   of each cell is determined by the hash value of its key and the
-   size of the table: location := hash(key) % size.  If two different
-   keys end up on the same position (collide), the one that came
-   second is stored in the first unoccupied cell that follows it.
-   This collision resolution technique is called "linear probing".
-
-   There are more advanced collision resolution methods (quadratic
-   probing, double hashing), but we don't use them because they incur
-   more non-sequential access to the array, which results in worse CPU
-   cache behavior.  Linear probing works well as long as the
-   count/size ratio (fullness) is kept below 75%.  We make sure to
-   grow and rehash the table whenever this threshold is exceeded.
-
-   Collisions complicate deletion because simply clearing a cell
-   followed by previously collided entries would cause those neighbors
-   to not be picked up by find_cell later.  One solution is to leave a
-   "tombstone" marker instead of clearing the cell, and another is to
-   recalculate the positions of adjacent cells.  We take the latter
-   approach because it results in less bookkeeping garbage and faster
-   retrieval at the (slight) expense of deletion.  */
-
-/* Maximum allowed fullness: when hash table's fullness exceeds this
-   value, the table is resized.  */
-#define HASH_MAX_FULLNESS 0.75
-
-/* The hash table size is multiplied by this factor (and then rounded
-   to the next prime) with each resize.  This guarantees infrequent
-   resizes.  */
-#define HASH_RESIZE_FACTOR 2
+   The hash table is an open-addressed table in the style of Abseil's
+   SwissTable.
+
+   The cells (each cell containing a key and a value pointer) are
+   stored in a contiguous array, and next to it there is an array of
+   control bytes, one per cell.  A control byte says whether its cell
+   is empty, deleted, or full; for a full cell it holds 7 bits of the
+   hash of the key (the cell's "tag").  The cells are divided into
+   groups of HT_GROUP_WIDTH adjacent cells, 16 when SSE2 is available and
+   8 otherwise, whose control bytes can be compared with a tag all at
+   once: with SSE2 instructions, or with arithmetic on a 64-bit word.
+
+   The rest of the hash picks the group where the search for a key
+   starts.  All cells in the group whose tags match the key's are
+   compared with the key, and if none of them is equal and the group
+   has an empty cell, the key is not in the table.  Otherwise the
+   following groups are searched the same way, the distance to the
+   next one growing by one group each time ("triangular" probing,
+   which visits every group once when their number is a power of two).
+
+   Only 1 in 128 non-matching cells has a matching tag, so the test
+   function is rarely called on a key that doesn't match, and the
+   cells are not read at all on most misses: a miss usually costs the
+   hash and one load of control bytes.
+
+   Removing a key marks its control byte as deleted (a "tombstone")
+   rather than empty, because later keys may have been placed past
+   its group when it was full; if the group still has an empty cell
+   that cannot be, and the cell is simply emptied.  Tombstones are
+   reused by insertions and dropped whenever the table is rehashed.
+
+   Each cell also keeps the full hash of its key.  The test function
+   is only called on cells whose hash is equal to the key's, and
+   moving a cell to another array doesn't call the hash function.
+
+   The table is resized once HT_MAX_FULLNESS of its cells are full
+   or deleted: into a table twice the size, or of the same size when
+   less than half of those are live keys.  The resize is incremental.
+   The new array is allocated at once, but each later put or remove
+   moves only the next HT_MIGRATE_CELLS cells of the old array into
+   it, so that no single operation pays for moving the whole table.
+   Until the old array is emptied, keys are looked up in both arrays
+   and new keys only go into the new one.  A moved cell is marked
+   deleted in the old array, so that searches there still go past it.
+
+   By the time the new array is as full as the old one was, the old
+   one is long gone: a doubled table has room for a whole old array's
+   worth of puts, and a same-size one (at most half full of keys) for
+   half of one, while moving the cells takes one operation per
+   HT_MIGRATE_CELLS of them.  */
+
+/* The tuning constants (HT_MAX_FULLNESS, HT_MIGRATE_CELLS...), the
+   control bytes and the group operations are shared with the
+   type-specialized tables of htable.h.  */
 
 struct cell {
   void *key;
   void *value;
+  unsigned long hash;           /* hash of KEY. */
 };
 
 typedef unsigned long (*hashfun_t) (const void *);
@@ -160,89 +185,34 @@ struct hash_table {
   testfun_t test_function;
 
   struct cell *cells;           /* contiguous array of cells. */
-  int size;                     /* size of the array. */
-
-  int count;                    /* number of occupied entries. */
-  int resize_threshold;         /* after size exceeds this number of
-                                   entries, resize the table.  */
-  int prime_offset;             /* the offset of the current prime in
-                                   the prime table. */
+  signed char *ctrl;            /* control bytes, one per cell and the
+                                   sentinel, allocated with CELLS.  */
+  long size;                    /* size of the array. */
+
+  long count;                   /* number of occupied entries, in
+                                   both arrays.  */
+  long growth_left;             /* number of empty cells that can be
+                                   filled before the table has to be
+                                   resized.  */
+
+  /* While the table is being resized, the array the keys are being
+     moved out of; those below OLD_POS have been.  OLD_CELLS is NULL
+     otherwise.  */
+  struct cell *old_cells;
+  signed char *old_ctrl;
+  long old_size;
+  long old_pos;
 };
 
-/* We use the all-bits-set constant (INVALID_PTR) marker to mean that
-   a cell is empty.  It is unaligned and therefore illegal as a
-   pointer.  INVALID_PTR_CHAR (0xff) is the single-character constant
-   used to initialize the entire cells array as empty.
-
-   The all-bits-set value is a better choice than NULL because it
-   allows the use of NULL/0 keys.  Since the keys are either integers
-   or pointers, the only key that cannot be used is the integer value
-   -1.  This is acceptable because it still allows the use of
-   nonnegative integer keys.  */
-
-#define INVALID_PTR ((void *) ~(uintptr_t) 0)
-#ifndef UCHAR_MAX
-# define UCHAR_MAX 0xff
-#endif
-#define INVALID_PTR_CHAR UCHAR_MAX
-
-/* Whether the cell C is occupied (non-empty). */
-#define CELL_OCCUPIED(c) ((c)->key != INVALID_PTR)
-
-/* Clear the cell C, i.e. mark it as empty (unoccupied). */
-#define CLEAR_CELL(c) ((c)->key = INVALID_PTR)
-
-/* "Next" cell is the cell following C, but wrapping back to CELLS
-   when C would reach CELLS+SIZE.  */
-#define NEXT_CELL(c, cells, size) (c != cells + (size - 1) ? c + 1 : cells)
-
-/* Loop over occupied cells starting at C, terminating the loop when
-   an empty cell is encountered.  */
-#define FOREACH_OCCUPIED_ADJACENT(c, cells, size)                               \
-  for (; CELL_OCCUPIED (c); c = NEXT_CELL (c, cells, size))
-
-/* Return the position of KEY in hash table SIZE large, hash function
-   being HASHFUN.  */
-#define HASH_POSITION(key, hashfun, size) ((hashfun) (key) % size)
-
-/* Find a prime near, but greather than or equal to SIZE.  The primes
-   are looked up from a table with a selection of primes convenient
-   for this purpose.
-
-   PRIME_OFFSET is a minor optimization: it specifies start position
-   for the search for the large enough prime.  The final offset is
-   stored in the same variable.  That way the list of primes does not
-   have to be scanned from the beginning each time around.  */
-
-static int
-prime_size (int size, int *prime_offset)
-{
-  static const int primes[] = {
-    13, 19, 29, 41, 59, 79, 107, 149, 197, 263, 347, 457, 599, 787, 1031,
-    1361, 1777, 2333, 3037, 3967, 5167, 6719, 8737, 11369, 14783,
-    19219, 24989, 32491, 42257, 54941, 71429, 92861, 120721, 156941,
-    204047, 265271, 344857, 448321, 582821, 757693, 985003, 1280519,
-    1664681, 2164111, 2813353, 3657361, 4754591, 6180989, 8035301,
-    10445899, 13579681, 17653589, 22949669, 29834603, 38784989,
-    50420551, 65546729, 85210757, 110774011, 144006217, 187208107,
-    243370577, 316381771, 411296309, 534685237, 695090819, 903618083,
-    1174703521, 1527114613, 1837299131, 2147483647
-  };
-  size_t i;
-
-  for (i = *prime_offset; i < countof (primes); i++)
-    if (primes[i] >= size)
-      {
-        /* Set the offset to the next prime.  That is safe because,
-           next time we are called, it will be with a larger SIZE,
-           which means we could never return the same prime anyway.
-           (If that is not the case, the caller can simply reset
-           *prime_offset.)  */
-        *prime_offset = i + 1;
-        return primes[i];
-      }
+/* Allocate cells and control bytes for a table SIZE large, all
+   empty.  */
 
-  abort ();
+static void
+alloc_cells (struct hash_table *ht, long size)
+{
+  ht->cells = ht_alloc_cells (size, sizeof (struct cell), &ht->ctrl);
+  ht->size = size;
+  ht->growth_left = HT_CAPACITY (size);
 }
 
 static int cmp_pointer (const void *, const void *);
@@ -259,8 +229,8 @@ static int cmp_pointer (const void *, const void *);
 
    Note that hash tables grow dynamically regardless of ITEMS.  The
    only use of ITEMS is to preallocate the table and avoid unnecessary
-   dynamic regrows.  Don't bother making ITEMS prime because it's not
-   used as size unchanged.  To start with a small table that grows as
+   dynamic regrows.  ITEMS is not used as size unchanged: the size is
+   rounded up to a power of two.  To start with a small table that grows as
    needed, simply specify zero ITEMS.
 
    If hash and test callbacks are not specified, identity mapping is
@@ -272,35 +242,22 @@ static int cmp_pointer (const void *, const void *);
    and make_nocase_string_hash_table.  */
 
 struct hash_table *
-hash_table_new (int items,
+hash_table_new (long items,
                 unsigned long (*hash_function) (const void *),
                 int (*test_function) (const void *, const void *))
 {
-  int size;
   struct hash_table *ht = xnew (struct hash_table);
 
   ht->hash_function = hash_function ? hash_function : hash_pointer;
   ht->test_function = test_function ? test_function : cmp_pointer;
 
-  /* If the size of struct hash_table ever becomes a concern, this
-     field can go.  (Wget doesn't create many hashes.)  */
-  ht->prime_offset = 0;
-
   /* Calculate the size that ensures that the table will store at
      least ITEMS keys without the need to resize.  */
-  size = 1 + items / HASH_MAX_FULLNESS;
-  size = prime_size (size, &ht->prime_offset);
-  ht->size = size;
-  ht->resize_threshold = size * HASH_MAX_FULLNESS;
-  /*assert (ht->resize_threshold >= items);*/
-
-  ht->cells = xnew_array (struct cell, ht->size);
-
-  /* Mark cells as empty.  We use 0xff rather than 0 to mark empty
-     keys because it allows us to use NULL/0 as keys.  */
-  memset (ht->cells, INVALID_PTR_CHAR, size * sizeof (struct cell));
-
+  alloc_cells (ht, ht_pow2_size (1 + items / HT_MAX_FULLNESS));
   ht->count = 0;
+  ht->old_cells = NULL;
+  ht->old_ctrl = NULL;
+  ht->old_size = ht->old_pos = 0;
 
   return ht;
 }
@@ -310,26 +267,66 @@ hash_table_new (int items,
 void
 hash_table_destroy (struct hash_table *ht)
 {
+  xfree (ht->old_cells);
   xfree (ht->cells);
   xfree (ht);
 }
 
-/* The heart of most functions in this file -- find the cell whose
-   KEY is equal to key, using linear probing.  Returns the cell
-   that matches KEY, or the first empty cell if none matches.  */
+/* Find the index of the cell of the array CELLS, with control bytes
+   CTRL and SIZE large, whose key is equal to KEY, whose hash is HASH.
+   Returns -1 if there is none.  */
+
+static inline long
+probe_cell (const struct cell *cells, const signed char *ctrl, long size,
+            testfun_t equals, const void *key, unsigned long hash)
+{
+  unsigned long groups = size / HT_GROUP_WIDTH;
+  unsigned long g = HT_GROUP (hash) & (groups - 1), step = 0;
+  signed char tag = HT_TAG (hash);
+
+  for (;;)
+    {
+      const signed char *gctrl = ctrl + g * HT_GROUP_WIDTH;
+      ht_mask_t m;
+
+      /* Keys fill their groups from the start, so a hit is most likely
+         there; fetch it while the control bytes are being loaded.  */
+      __builtin_prefetch (cells + g * HT_GROUP_WIDTH);
+      m = ht_match (gctrl, tag);
+
+      for (; m; HT_MASK_NEXT (m))
+        {
+          long i = g * HT_GROUP_WIDTH + HT_MASK_INDEX (m);
+          if (cells[i].hash == hash && equals (key, cells[i].key))
+            return i;
+        }
+      if (ht_match_empty (gctrl))
+        return -1;
+
+      g = (g + ++step) & (groups - 1);
+    }
+}
+
+/* The heart of most functions in this file -- find the cell whose key
+   is equal to KEY, whose hash is HASH, in either array.  Returns NULL
+   if there is none.  */
 
 static inline struct cell *
-find_cell (const struct hash_table *ht, const void *key)
+find_cell (const struct hash_table *ht, const void *key, unsigned long hash)
 {
-  struct cell *cells = ht->cells;
-  int size = ht->size;
-  struct cell *c = cells + HASH_POSITION (key, ht->hash_function, size);
-  testfun_t equals = ht->test_function;
+  long i = probe_cell (ht->cells, ht->ctrl, ht->size, ht->test_function,
+                      key, hash);
+  if (i >= 0)
+    return ht->cells + i;
 
-  FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-    if (equals (key, c->key))
-      break;
-  return c;
+  if (ht->old_cells)
+    {
+      i = probe_cell (ht->old_cells, ht->old_ctrl, ht->old_size,
+                      ht->test_function, key, hash);
+      if (i >= 0)
+        return ht->old_cells + i;
+    }
+  return NULL;
 }
 
 /* Get the value that corresponds to the key KEY in the hash table HT.
@@ -342,8 +339,8 @@ find_cell (const struct hash_table *ht, const void *key)
 void *
 hash_table_get (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
+  struct cell *c = find_cell (ht, key, ht->hash_function (key));
+  if (c)
     return c->value;
   else
     return NULL;
@@ -356,8 +353,8 @@ int
 hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
                      void *orig_key, void *value)
 {
-  struct cell *c = find_cell (ht, lookup_key);
-  if (CELL_OCCUPIED (c))
+  struct cell *c = find_cell (ht, lookup_key, ht->hash_function (lookup_key));
+  if (c)
     {
       if (orig_key)
         *(void **)orig_key = c->key;
@@ -374,61 +371,152 @@ hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
 int
 hash_table_contains (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  return CELL_OCCUPIED (c);
+  return find_cell (ht, key, ht->hash_function (key)) != NULL;
+}
+
+/* Put the cell C, whose key is not in the table, in the new array. */
+
+static inline void
+place_cell (struct hash_table *ht, const struct cell *c)
+{
+  long j = ht_find_free (ht->ctrl, ht->size, c->hash);
+  if (ht->ctrl[j] == HT_EMPTY)
+    --ht->growth_left;
+  ht->ctrl[j] = HT_TAG (c->hash);
+  ht->cells[j] = *c;
 }
 
-/* Grow hash table HT as necessary, and rehash all the key-value
-   mappings.  */
+/* Move the next N cells of the old array of HT, if it is being
+   resized, into the new one, and free the old array once it has all
+   been moved.  */
+
+static void
+migrate_cells (struct hash_table *ht, long n)
+{
+  long i, end;
+
+  if (!ht->old_cells)
+    return;
+
+  end = ht->old_size - ht->old_pos > n ? ht->old_pos + n : ht->old_size;
+  for (i = ht->old_pos; i < end; i++)
+    if (HT_FULL (ht->old_ctrl[i]))
+      {
+        /* We don't need to test for uniqueness of keys because they
+           come from the hash table and are therefore known to be
+           unique.  */
+        place_cell (ht, ht->old_cells + i);
+        ht->old_ctrl[i] = HT_DELETED;
+      }
+  ht->old_pos = end;
+
+  if (end == ht->old_size)
+    {
+      xfree (ht->old_cells);
+      ht->old_cells = NULL;
+      ht->old_ctrl = NULL;
+    }
+}
+
+/* Start resizing HT: allocate a new array twice the size, or of the
+   same size if most of the cells taken are tombstones, for the keys to
+   be moved to by migrate_cells.  */
 
 static void
 grow_hash_table (struct hash_table *ht)
 {
-  hashfun_t hasher = ht->hash_function;
-  struct cell *old_cells = ht->cells;
-  struct cell *old_end   = ht->cells + ht->size;
-  struct cell *c, *cells;
-  int newsize;
+  long newsize;
 
-  newsize = prime_size (ht->size * HASH_RESIZE_FACTOR, &ht->prime_offset);
+  /* The previous resize ought to have long finished (see the
+     comment at the top); if it somehow hasn't, finish it now.  */
+  migrate_cells (ht, ht->old_size);
+
+  if (ht->count <= HT_CAPACITY (ht->size) / 2)
+    newsize = ht->size;
+  else
+    newsize = ht_pow2_size (ht->size * HT_RESIZE_FACTOR);
 #if 0
-  printf ("growing from %d to %d; fullness %.2f%% to %.2f%%\n",
+  printf ("growing from %ld to %ld; fullness %.2f%% to %.2f%%\n",
           ht->size, newsize,
           100.0 * ht->count / ht->size,
           100.0 * ht->count / newsize);
 #endif
 
-  ht->size = newsize;
-  ht->resize_threshold = newsize * HASH_MAX_FULLNESS;
+  ht->old_cells = ht->cells;
+  ht->old_ctrl = ht->ctrl;
+  ht->old_size = ht->size;
+  ht->old_pos = 0;
+  alloc_cells (ht, newsize);
+}
 
-  cells = xnew_array (struct cell, newsize);
-  memset (cells, INVALID_PTR_CHAR, newsize * sizeof (struct cell));
-  ht->cells = cells;
+/* Move all the entries of HT at once into a new array SIZE large. */
 
-  for (c = old_cells; c < old_end; c++)
-    if (CELL_OCCUPIED (c))
-      {
-        struct cell *new_c;
-        /* We don't need to test for uniqueness of keys because they
-           come from the hash table and are therefore known to be
-           unique.  */
-        new_c = cells + HASH_POSITION (c->key, hasher, newsize);
-        FOREACH_OCCUPIED_ADJACENT (new_c, cells, newsize)
-          ;
-        *new_c = *c;
-      }
+static void
+rehash_to (struct hash_table *ht, long size)
+{
+  struct cell *old_cells;
+  signed char *old_ctrl;
+  long old_size, i;
+
+  migrate_cells (ht, ht->old_size);
+
+  old_cells = ht->cells;
+  old_ctrl = ht->ctrl;
+  old_size = ht->size;
+  alloc_cells (ht, size);
+
+  for (i = 0; i < old_size; i++)
+    if (HT_FULL (old_ctrl[i]))
+      place_cell (ht, old_cells + i);
 
   xfree (old_cells);
 }
 
+/* Make room in HT for ITEMS entries in all, so that it doesn't resize
+   again before it has as many.  Unlike the resizes done by
+   hash_table_put, this moves all the entries at once: it is meant for
+   before adding a known number of keys.  */
+
+void
+hash_table_reserve (struct hash_table *ht, long items)
+{
+  long size;
+
+  migrate_cells (ht, ht->old_size);
+  if (items - ht->count <= ht->growth_left)
+    return;
+
+  /* Not enough room may also mean too many tombstones. */
+  size = ht_pow2_size (1 + items / HT_MAX_FULLNESS);
+  rehash_to (ht, size > ht->size ? size : ht->size);
+}
+
+/* Rehash HT into the smallest array that holds ITEMS entries, or all
+   it has if that is more, dropping its tombstones.  This may shrink
+   the table.  */
+
+void
+hash_table_rehash (struct hash_table *ht, long items)
+{
+  if (items < ht->count)
+    items = ht->count;
+  rehash_to (ht, ht_pow2_size (1 + items / HT_MAX_FULLNESS));
+}
+
 /* Put VALUE in the hash table HT under the key KEY.  This regrows the
    table if necessary.  */
 
 void
 hash_table_put (struct hash_table *ht, const void *key, const void *value)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
+  unsigned long hash = ht->hash_function (key);
+  struct cell *c;
+  long i;
+
+  migrate_cells (ht, HT_MIGRATE_CELLS);
+
+  c = find_cell (ht, key, hash);
+  if (c)
     {
       /* update existing item */
       c->key   = (void *)key;    /* const? */
@@ -436,18 +524,24 @@ hash_table_put (struct hash_table *ht, const void *key, const void *value)
       return;
     }
 
-  /* If adding the item would make the table exceed max. fullness,
-     grow the table first.  */
-  if (ht->count >= ht->resize_threshold)
+  /* Reusing a tombstone doesn't make the table any fuller.  If taking
+     an empty cell would make it exceed max. fullness, grow the table
+     first.  */
+  i = ht_find_free (ht->ctrl, ht->size, hash);
+  if (ht->ctrl[i] == HT_EMPTY && ht->growth_left == 0)
     {
       grow_hash_table (ht);
-      c = find_cell (ht, key);
+      i = ht_find_free (ht->ctrl, ht->size, hash);
     }
 
   /* add new item */
+  if (ht->ctrl[i] == HT_EMPTY)
+    --ht->growth_left;
   ++ht->count;
-  c->key   = (void *)key;       /* const? */
-  c->value = (void *)value;
+  ht->ctrl[i] = HT_TAG (hash);
+  ht->cells[i].key   = (void *)key;       /* const? */
+  ht->cells[i].value = (void *)value;
+  ht->cells[i].hash  = hash;
 }
 
 /* Remove KEY->value mapping from HT.  Return 0 if there was no such
@@ -456,45 +550,30 @@ hash_table_put (struct hash_table *ht, const void *key, const void *value)
 int
 hash_table_remove (struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (!CELL_OCCUPIED (c))
-    return 0;
-  else
-    {
-      int size = ht->size;
-      struct cell *cells = ht->cells;
-      hashfun_t hasher = ht->hash_function;
-
-      CLEAR_CELL (c);
-      --ht->count;
+  unsigned long hash = ht->hash_function (key);
+  long i;
 
-      /* Rehash all the entries following C.  The alternative
-         approach is to mark the entry as deleted, i.e. create a
-         "tombstone".  That speeds up removal, but leaves a lot of
-         garbage and slows down hash_table_get and hash_table_put.  */
+  migrate_cells (ht, HT_MIGRATE_CELLS);
 
-      c = NEXT_CELL (c, cells, size);
-      FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-        {
-          const void *key2 = c->key;
-          struct cell *c_new;
-
-          /* Find the new location for the key. */
-          c_new = cells + HASH_POSITION (key2, hasher, size);
-          FOREACH_OCCUPIED_ADJACENT (c_new, cells, size)
-            if (key2 == c_new->key)
-              /* The cell C (key2) is already where we want it (in
-                 C_NEW's "chain" of keys.)  */
-              goto next_rehash;
-
-          *c_new = *c;
-          CLEAR_CELL (c);
-
-        next_rehash:
-          ;
-        }
+  i = probe_cell (ht->cells, ht->ctrl, ht->size, ht->test_function,
+                  key, hash);
+  if (i < 0)
+    {
+      if (!ht->old_cells)
+        return 0;
+      i = probe_cell (ht->old_cells, ht->old_ctrl, ht->old_size,
+                      ht->test_function, key, hash);
+      if (i < 0)
+        return 0;
+      /* The old array is going away; a tombstone will do.  */
+      ht->old_ctrl[i] = HT_DELETED;
+      --ht->count;
       return 1;
     }
+
+  ht->growth_left += ht_clear_cell (ht->ctrl, i);
+  --ht->count;
+  return 1;
 }
 
 /* Clear HT of all entries.  After calling this function, the count
@@ -504,7 +583,11 @@ hash_table_remove (struct hash_table *ht, const void *key)
 void
 hash_table_clear (struct hash_table *ht)
 {
-  memset (ht->cells, INVALID_PTR_CHAR, ht->size * sizeof (struct cell));
+  xfree (ht->old_cells);
+  ht->old_cells = NULL;
+  ht->old_ctrl = NULL;
+  memset (ht->ctrl, (unsigned char) HT_EMPTY, ht->size);
+  ht->growth_left = HT_CAPACITY (ht->size);
   ht->count = 0;
 }
 
@@ -515,29 +598,21 @@ hash_table_clear (struct hash_table *ht)
    It is undefined what happens if you add or remove entries in the
    hash table while hash_table_for_each is running.  The exception is
    the entry you're currently mapping over; you may call
-   hash_table_put or hash_table_remove on that entry's key.  That is
-   also the reason why this function cannot be implemented in terms of
-   hash_table_iterate.  */
+   hash_table_put or hash_table_remove on that entry's key.  Neither
+   moves other entries: a resize in progress is finished first.  */
 
 void
 hash_table_for_each (struct hash_table *ht,
                      int (*fn) (void *, void *, void *), void *arg)
 {
-  struct cell *c = ht->cells;
-  struct cell *end = ht->cells + ht->size;
+  long i;
 
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
-      {
-        void *key;
-      repeat:
-        key = c->key;
-        if (fn (key, c->value, arg))
-          return;
-        /* hash_table_remove might have moved the adjacent cells. */
-        if (c->key != key && CELL_OCCUPIED (c))
-          goto repeat;
-      }
+  migrate_cells (ht, ht->old_size);
+
+  for (i = 0; i < ht->size; i++)
+    if (HT_FULL (ht->ctrl[i]))
+      if (fn (ht->cells[i].key, ht->cells[i].value, arg))
+        return;
 }
 
 /* Initiate iteration over HT.  Entries are obtained with
@@ -553,8 +628,10 @@ hash_table_for_each (struct hash_table *ht,
 void
 hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 {
+  /* Visiting every entry costs as much as finishing a resize. */
+  migrate_cells (ht, ht->old_size);
   iter->pos = ht->cells;
-  iter->end = ht->cells + ht->size;
+  iter->ctrl = ht->ctrl;
 }
 
 /* Get the next hash table entry.  ITER is an iterator object
@@ -570,15 +647,19 @@ int
 hash_table_iter_next (hash_table_iterator *iter)
 {
   struct cell *c = iter->pos;
-  struct cell *end = iter->end;
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
+  signed char *ctrl = iter->ctrl;
+
+  for (; *ctrl != HT_SENTINEL; c++, ctrl++)
+    if (HT_FULL (*ctrl))
       {
         iter->key = c->key;
         iter->value = c->value;
         iter->pos = c + 1;
+        iter->ctrl = ctrl + 1;
         return 1;
       }
+  iter->pos = c;
+  iter->ctrl = ctrl;
   return 0;
 }
 
@@ -586,12 +667,12 @@ hash_table_iter_next (hash_table_iterator *iter)
    same as the physical size of the hash table, which is always
    greater than the number of elements.  */
 
-int
+long
 hash_table_count (const struct hash_table *ht)
 {
   return ht->count;
 }
-
+
 /* Functions from this point onward are meant for convenience and
    don't strictly belong to this file.  However, this is as good a
    place for them as any.  */
@@ -626,31 +707,160 @@ hash_table_count (const struct hash_table *ht)
      react to even small changes in input with a completely different
      output.  But don't make the hash function itself overly slow,
      because you'll be incurring a non-negligible overhead to all hash
-     table operations.  */
+     table operations.
+
+   - The table takes the low bits of the hash as the position, so
+     those in particular must depend on every bit of the key.  */
 
 /*
  * Support for hash tables whose keys are strings.
  *
  */
 
-/* Base 31 hash function.  Taken from Gnome's glib, modified to use
-   standard C types.
+/* Word-at-a-time string hash in the style of wyhash.  The key is read
+   8 or 16 bytes at a time and each pair of words is folded in with a
+   64x64->128 bit multiplication, whose two halves are xored together.
+   That mixes every input bit into every output bit, so keys sharing a
+   long prefix (as URLs from one site do) still spread over the whole
+   table, and it costs a couple of multiplications per 16 bytes rather
+   than one per byte.
 
-   We used to use the popular hash function from the Dragon Book, but
-   this one seems to perform much better, both by being faster and by
-   generating less collisions.  */
+   The hash is only meant for in-memory tables: it depends on the byte
+   order, and the seed and constants may change.  Use hash_string64
+   for digests that are stored.  */
 
-static unsigned long
-hash_string (const void *key)
+#define WY_P0 0xa0761d6478bd642fULL
+#define WY_P1 0xe7037ed1a0b428dbULL
+#define WY_P2 0x8ebc6af09c88c6e3ULL
+#define WY_P3 0x589965cc75374cc3ULL
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 wy_u128;
+
+static inline unsigned long long
+wy_mix (unsigned long long a, unsigned long long b)
 {
-  const char *p = key;
-  unsigned int h = *p;
+  wy_u128 r = (wy_u128) a * b;
+  return (unsigned long long) r ^ (unsigned long long) (r >> 64);
+}
+#else
+static inline unsigned long long
+wy_mix (unsigned long long a, unsigned long long b)
+{
+  unsigned long long ha = a >> 32, hb = b >> 32;
+  unsigned long long la = (unsigned int) a, lb = (unsigned int) b;
+  unsigned long long rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  unsigned long long t = rl + (rm0 << 32), c = t < rl;
+  unsigned long long lo = t + (rm1 << 32);
+  c += lo < t;
+  return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+}
+#endif
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+/* Lower-case the ASCII letters among the bytes of W, all at once.
+   Bytes with the top bit set are left alone, as c_tolower does in the
+   C locale.  Adding 0x3f (0x25) to the low 7 bits of a byte sets its
+   top bit exactly when it is >= 'A' (> 'Z'), without carrying into the
+   next byte.  */
 
-  return h;
+#define ASCII_LOWER(w, ones)                                            \
+  ((w) | (((~(w) & 0x80 * (ones))                                       \
+           & ((((w) & 0x7f * (ones)) + 0x3f * (ones))                   \
+              ^ (((w) & 0x7f * (ones)) + 0x25 * (ones)))) >> 2))
+
+static inline unsigned long long
+wy_read8 (const unsigned char *p, int nocase)
+{
+  unsigned long long w;
+  memcpy (&w, p, sizeof w);
+  return nocase ? ASCII_LOWER (w, 0x0101010101010101ULL) : w;
+}
+
+static inline unsigned long long
+wy_read4 (const unsigned char *p, int nocase)
+{
+  unsigned int w;
+  memcpy (&w, p, sizeof w);
+  return nocase ? ASCII_LOWER (w, 0x01010101U) : w;
+}
+
+static inline unsigned long long
+wy_read1 (const unsigned char *p, int nocase)
+{
+  return nocase ? (unsigned char) c_tolower (*p) : *p;
+}
+
+/* Hash LEN bytes at P.  With NOCASE, ASCII letters are hashed as if
+   they were lower-case.  NOCASE is a constant at every call, so the
+   test disappears when this is inlined.  */
+
+static inline unsigned long long
+wy_hash (const unsigned char *p, size_t len, int nocase)
+{
+  unsigned long long seed = wy_mix (WY_P0, WY_P1), a, b;
+  size_t i = len;
+
+  if (len <= 16)
+    {
+      if (len >= 4)
+        {
+          size_t mid = (len >> 3) << 2;
+          a = (wy_read4 (p, nocase) << 32) | wy_read4 (p + mid, nocase);
+          b = (wy_read4 (p + len - 4, nocase) << 32)
+            | wy_read4 (p + len - 4 - mid, nocase);
+        }
+      else if (len > 0)
+        {
+          a = (wy_read1 (p, nocase) << 16)
+            | (wy_read1 (p + (len >> 1), nocase) << 8)
+            | wy_read1 (p + len - 1, nocase);
+          b = 0;
+        }
+      else
+        a = b = 0;
+    }
+  else
+    {
+      if (i > 48)
+        {
+          unsigned long long see1 = seed, see2 = seed;
+          do
+            {
+              seed = wy_mix (wy_read8 (p, nocase) ^ WY_P1,
+                             wy_read8 (p + 8, nocase) ^ seed);
+              see1 = wy_mix (wy_read8 (p + 16, nocase) ^ WY_P2,
+                             wy_read8 (p + 24, nocase) ^ see1);
+              see2 = wy_mix (wy_read8 (p + 32, nocase) ^ WY_P3,
+                             wy_read8 (p + 40, nocase) ^ see2);
+              p += 48;
+              i -= 48;
+            }
+          while (i > 48);
+          seed ^= see1 ^ see2;
+        }
+      while (i > 16)
+        {
+          seed = wy_mix (wy_read8 (p, nocase) ^ WY_P1,
+                         wy_read8 (p + 8, nocase) ^ seed);
+          p += 16;
+          i -= 16;
+        }
+      /* The last 16 bytes, overlapping what came before if need be. */
+      a = wy_read8 (p + i - 16, nocase);
+      b = wy_read8 (p + i - 8, nocase);
+    }
+
+  return wy_mix (WY_P1 ^ len, wy_mix (a ^ WY_P1, b ^ seed));
+}
+
+/* The hash of the string KEY, also used by the string-keyed tables of
+   htable.h.  */
+
+unsigned long
+hash_string (const void *key)
+{
+  const char *p = key;
+  return (unsigned long) wy_hash ((const unsigned char *) p, strlen (p), 0);
 }
 
 /* Frontend for strcmp usable for hash tables. */
@@ -665,11 +875,35 @@ cmp_string (const void *s1, const void *s2)
    suitable to use strings as keys.  */
 
 struct hash_table *
-make_string_hash_table (int items)
+make_string_hash_table (long items)
 {
   return hash_table_new (items, hash_string, cmp_string);
 }
 
+/* 64-bit FNV-1a with a splitmix64 finalizer.  Used where a string
+   needs a wide, well-mixed digest rather than a bucket index, e.g. for
+   URL fingerprints and Bloom filter probes.  */
+
+unsigned long long
+hash_string64 (const char *key)
+{
+  const unsigned char *p = (const unsigned char *) key;
+  unsigned long long h = 0xcbf29ce484222325ULL;
+
+  for (; *p; p++)
+    {
+      h ^= *p;
+      h *= 0x100000001b3ULL;
+    }
+
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
 /*
  * Support for hash tables whose keys are strings, but which are
  * compared case-insensitively.
@@ -682,13 +916,7 @@ static unsigned long
 hash_string_nocase (const void *key)
 {
   const char *p = key;
-  unsigned int h = c_tolower (*p);
-
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + c_tolower (*p);
-
-  return h;
+  return (unsigned long) wy_hash ((const unsigned char *) p, strlen (p), 1);
 }
 
 /* Like string_cmp, but doing case-insensitive compareison. */
@@ -703,7 +931,7 @@ string_cmp_nocase (const void *s1, const void *s2)
    string_cmp_nocase.  */
 
 struct hash_table *
-make_nocase_string_hash_table (int items)
+make_nocase_string_hash_table (long items)
 {
   return hash_table_new (items, hash_string_nocase, string_cmp_nocase);
 }
@@ -728,7 +956,7 @@ hash_pointer (const void *ptr)
   key ^= (key >> 2);
   key += (key << 7);
   key ^= (key >> 12);
-#if SIZEOF_VOID_P > 4
+#if SIZEOF_VOID_P > 4 || (!defined SIZEOF_VOID_P && __SIZEOF_POINTER__ > 4)
   key += (key << 44);
   key ^= (key >> 54);
   key += (key << 36);
@@ -793,8 +1021,280 @@ main (void)
   print_hash (ht);
 #endif
 #if 1
-  printf ("%d %d\n", ht->count, ht->size);
+  printf ("%ld %ld\n", ht->count, ht->size);
 #endif
   return 0;
 }
 #endif /* TEST */
+
+#ifdef BENCH
+
+/* Compare the old string hashing scheme (base 31 hash, prime sizes,
+   position by remainder) with the current one on a corpus of keys,
+   one per line, e.g.
+
+       make bench
+       ./hash_bench urls 1000000
+
+   With a number of keys larger than the corpus, more are made up by
+   adding query strings to its lines.
+
+   For each scheme this reports the cost of hashing alone, how many
+   keys share a full hash value, the probe lengths in a linear probing
+   table 3/4 full, and the cost of a lookup (hash, probe, compare).
+   Finally the actual hash table is timed: filling it from empty, and
+   looking up keys it has and keys it doesn't, and the latency of
+   single puts while it grows.  */
+
+#include <time.h>
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long
+hash_string_base31 (const void *key)
+{
+  const char *p = key;
+  unsigned int h = *p;
+
+  if (h)
+    for (p += 1; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
+
+  return h;
+}
+
+static int
+bench_next_prime (int n)
+{
+  int d;
+
+  for (;; n++)
+    {
+      for (d = 2; d * d <= n; d++)
+        if (n % d == 0)
+          break;
+      if (d * d > n && n > 1)
+        return n;
+    }
+}
+
+static int
+cmp_ulong (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Bucket of KEY in a table of SIZE cells under either scheme. */
+#define BENCH_POSITION(h, size, prime) \
+  ((prime) ? (h) % (unsigned long) (size) : (h) & ((size) - 1))
+
+static void
+bench_scheme (const char *name, char **keys, int n, int rounds,
+              hashfun_t hash, int prime)
+{
+  int size, *slots, i, r, pos, probes, max_probes = 0, lookup_rounds;
+  long total_probes = 0, found = 0;
+  unsigned long *hashes, sink = 0;
+  int dups = 0;
+  double t0, t_hash, t_lookup;
+
+  size = 1 + n / 0.75;
+  size = prime ? bench_next_prime (size) : ht_pow2_size (size);
+
+  /* hashing alone */
+  t0 = bench_now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      sink += hash (keys[i]);
+  t_hash = bench_now () - t0;
+
+  /* keys sharing a full hash value */
+  hashes = xnew_array (unsigned long, n);
+  for (i = 0; i < n; i++)
+    hashes[i] = hash (keys[i]);
+  qsort (hashes, n, sizeof *hashes, cmp_ulong);
+  for (i = 1; i < n; i++)
+    dups += hashes[i] == hashes[i - 1];
+  xfree (hashes);
+
+  /* linear probing, as in find_cell */
+  slots = xnew_array (int, size);
+  memset (slots, 0xff, size * sizeof *slots);
+  for (i = 0; i < n; i++)
+    {
+      pos = BENCH_POSITION (hash (keys[i]), size, prime);
+      for (probes = 1; slots[pos] >= 0; probes++)
+        pos = pos + 1 < size ? pos + 1 : 0;
+      slots[pos] = i;
+      total_probes += probes;
+      if (probes > max_probes)
+        max_probes = probes;
+    }
+
+  /* a scheme that clusters badly gets a second or so */
+  t0 = bench_now ();
+  for (r = 0; r < rounds && (r == 0 || bench_now () - t0 < 1.0); r++)
+    for (i = 0; i < n; i++)
+      {
+        pos = BENCH_POSITION (hash (keys[i]), size, prime);
+        while (slots[pos] >= 0 && strcmp (keys[slots[pos]], keys[i]) != 0)
+          pos = pos + 1 < size ? pos + 1 : 0;
+        found += slots[pos] >= 0;
+      }
+  t_lookup = bench_now () - t0;
+  lookup_rounds = r;
+  xfree (slots);
+
+  printf ("%-10s %8d %8.1f %8d %10.2f %6d %10.1f%s\n", name, size,
+          1e9 * t_hash / ((double) rounds * n), dups,
+          (double) total_probes / n, max_probes,
+          1e9 * t_lookup / ((double) lookup_rounds * n),
+          found == (long) lookup_rounds * n && sink != 1 ? "" : "  (lost keys!)");
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *file = argc > 1 ? argv[1] : "urls";
+  int want = argc > 2 ? atoi (argv[2]) : 0;
+  struct hash_table *seen, *ht;
+  char line[4096], **keys, **misses;
+  int n = 0, cap = 1024, corpus, rounds, i, r;
+  long found = 0;
+  double t0, t_put, t_hit, t_miss, *lat;
+  FILE *fp = fopen (file, "r");
+
+  if (fp == NULL)
+    {
+      perror (file);
+      return 1;
+    }
+
+  /* distinct lines of the corpus */
+  keys = xnew_array (char *, cap);
+  seen = make_string_hash_table (0);
+  while (fgets (line, sizeof line, fp))
+    {
+      line[strcspn (line, "\r\n")] = '\0';
+      if (line[0] == '\0' || hash_table_contains (seen, line))
+        continue;
+      if (n == cap)
+        keys = realloc (keys, (cap *= 2) * sizeof *keys);
+      keys[n] = strdup (line);
+      hash_table_put (seen, keys[n++], NULL);
+    }
+  fclose (fp);
+  hash_table_destroy (seen);
+
+  if (n == 0)
+    {
+      fprintf (stderr, "%s: no keys\n", file);
+      return 1;
+    }
+
+  /* made-up ones, distinct from the corpus and each other */
+  corpus = n;
+  if (want > n)
+    {
+      keys = realloc (keys, want * sizeof *keys);
+      for (; n < want; n++)
+        {
+          const char *base = keys[n % corpus];
+          snprintf (line, sizeof line, "%s%cbench=%d", base,
+                    strchr (base, '?') ? '&' : '?', n / corpus);
+          keys[n] = strdup (line);
+        }
+    }
+
+  /* keys that are not in the table */
+  misses = xnew_array (char *, n);
+  for (i = 0; i < n; i++)
+    {
+      snprintf (line, sizeof line, "%s#miss", keys[i]);
+      misses[i] = strdup (line);
+    }
+
+  /* about ten million operations of each kind */
+  rounds = 10000000 / n + 1;
+  printf ("%d distinct keys (%d from %s), %d rounds\n\n",
+          n, corpus, file, rounds);
+
+  printf ("%-10s %8s %8s %8s %10s %6s %10s\n", "scheme", "size",
+          "ns/hash", "same h", "avg probe", "max", "ns/lookup");
+  bench_scheme ("base31 %", keys, n, rounds, hash_string_base31, 1);
+  bench_scheme ("wyhash &", keys, n, rounds, hash_string, 0);
+
+  /* the real thing, growing from empty */
+  t0 = bench_now ();
+  for (r = 0; r < rounds / 10 + 1; r++)
+    {
+      ht = make_string_hash_table (0);
+      for (i = 0; i < n; i++)
+        hash_table_put (ht, keys[i], keys[i]);
+      if (r < rounds / 10)
+        hash_table_destroy (ht);
+    }
+  t_put = bench_now () - t0;
+
+  t0 = bench_now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found += hash_table_get (ht, keys[i]) == keys[i];
+  t_hit = bench_now () - t0;
+
+  t0 = bench_now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found -= hash_table_contains (ht, misses[i]);
+  t_miss = bench_now () - t0;
+
+  printf ("\nhash table of %ld: put %.1f ns, hit %.1f ns, miss %.1f ns%s\n",
+          hash_table_count (ht),
+          1e9 * t_put / ((double) (rounds / 10 + 1) * n),
+          1e9 * t_hit / ((double) rounds * n),
+          1e9 * t_miss / ((double) rounds * n),
+          found == (long) rounds * n ? "" : "  (wrong results!)");
+  hash_table_destroy (ht);
+
+  /* the latency of single puts, resizes included */
+  lat = xnew_array (double, n);
+  ht = make_string_hash_table (0);
+  for (i = 0; i < n; i++)
+    {
+      t0 = bench_now ();
+      hash_table_put (ht, keys[i], keys[i]);
+      lat[i] = bench_now () - t0;
+    }
+  qsort (lat, n, sizeof *lat, cmp_double);
+  printf ("put latency: p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f us\n",
+          1e9 * lat[n / 2], 1e9 * lat[n - n / 100 - 1],
+          1e9 * lat[n - n / 1000 - 1], 1e6 * lat[n - 1]);
+  xfree (lat);
+
+  hash_table_destroy (ht);
+  for (i = 0; i < n; i++)
+    {
+      xfree (keys[i]);
+      xfree (misses[i]);
+    }
+  xfree (keys);
+  xfree (misses);
+  return 0;
+}
+#endif /* BENCH */
@@ -3,7 +3,7 @@
 
 struct hash_table;
 
-struct hash_table *hash_table_new (int, unsigned long (*) (const void *),
+struct hash_table *hash_table_new (long, unsigned long (*) (const void *),
 				   int (*) (const void *, const void *));
 void hash_table_destroy (struct hash_table *);
 
@@ -15,21 +15,26 @@ int hash_table_contains (const struct hash_table *, const void *);
 void hash_table_put (struct hash_table *, const void *, const void *);
 int hash_table_remove (struct hash_table *, const void *);
 void hash_table_clear (struct hash_table *);
+void hash_table_reserve (struct hash_table *, long);
+void hash_table_rehash (struct hash_table *, long);
 
 void hash_table_for_each (struct hash_table *,
 		          int (*) (void *, void *, void *), void *);
 
 typedef struct {
   void *key, *value;		/* public members */
-  void *pos, *end;		/* private members */
+  void *pos, *ctrl;		/* private members */
 } hash_table_iterator;
 void hash_table_iterate (struct hash_table *, hash_table_iterator *);
 int hash_table_iter_next (hash_table_iterator *);
 
-int hash_table_count (const struct hash_table *);
+long hash_table_count (const struct hash_table *);
 
-struct hash_table *make_string_hash_table (int);
-struct hash_table *make_nocase_string_hash_table (int);
+struct hash_table *make_string_hash_table (long);
+struct hash_table *make_nocase_string_hash_table (long);
+
+unsigned long hash_string (const void *);
+unsigned long long hash_string64 (const char *);
 
 unsigned long hash_pointer (const void *);
 
@@ -0,0 +1,524 @@
+#ifndef _HTABLE_H
+#define _HTABLE_H
+
+/*
+ * Type-specialized hash tables.  HTABLE_DEFINE(name, key_t, value_t,
+ * hash, equal) defines struct name, a table from key_t to value_t
+ * whose keys and values are stored in the cells themselves, and static
+ * inline functions name_init, name_get, name_put and so on to use it.
+ * HASH(key) and EQUAL(a, b) may be macros or functions; either way
+ * they are called directly, not through pointers.
+ *
+ * The tables work like the generic ones of hash.c (see the comment at
+ * the top of it): SwissTable groups of control bytes, hashes cached in
+ * the cells, and incremental resizing.  The group operations below are
+ * shared with it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/* Maximum fullness before a table is resized. */
+#define HT_MAX_FULLNESS 0.875
+
+/* Tables double with each resize, keeping their size a power of two. */
+#define HT_RESIZE_FACTOR 2
+
+/* The smallest table allocated; it must hold at least one group. */
+#define HT_MIN_SIZE 16
+
+/* Cell arrays this large are aligned to and backed by huge pages,
+   where the system has them. */
+#define HT_HUGE_PAGE (2 * 1024 * 1024)
+
+#if defined __SSE2__ && !defined HASH_NO_SSE2
+#include <emmintrin.h>
+#define HT_GROUP_WIDTH 16
+#else
+#define HT_GROUP_WIDTH 8
+#endif
+
+/* The number of cells of the old array moved by each operation while
+   a table is being resized.  Fewer make each of those operations
+   cheaper, but leave lookups searching two arrays for longer; at least
+   3 are needed for the resize to end in time. */
+#define HT_MIGRATE_CELLS 8
+
+/* Control bytes.  Full cells have the (nonnegative) tag; the others
+   have the sign bit set.  The sentinel follows the last control byte
+   and stops iterators. */
+#define HT_EMPTY    ((signed char)-128)
+#define HT_DELETED  ((signed char)-2)
+#define HT_SENTINEL ((signed char)-1)
+
+#define HT_FULL(c) ((c) >= 0)
+
+/* The tag of a key and the group where its search starts. */
+#define HT_TAG(hash) ((signed char)((hash) & 0x7f))
+#define HT_GROUP(hash) ((hash) >> 7)
+
+/* The number of cells a table SIZE large can fill before it has to be
+   resized. */
+#define HT_CAPACITY(size) ((long)((size) * HT_MAX_FULLNESS))
+
+/* Operations on the control bytes of the group at CTRL.  Each returns
+   a mask with a bit set for each cell in the group with the given
+   property; the index of the lowest such cell is HT_MASK_INDEX of the
+   mask, and HT_MASK_NEXT clears it. */
+
+typedef unsigned long long ht_mask_t;
+
+#if HT_GROUP_WIDTH == 16
+
+#define HT_MASK_INDEX(m) __builtin_ctzll(m)
+
+/* Cells with tag TAG. */
+static inline ht_mask_t ht_match(const signed char *ctrl, signed char tag)
+{
+	__m128i g = _mm_load_si128((const __m128i *)ctrl);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), g));
+}
+
+/* Empty cells. */
+static inline ht_mask_t ht_match_empty(const signed char *ctrl)
+{
+	return ht_match(ctrl, HT_EMPTY);
+}
+
+/* Empty or deleted cells, i.e. those a new key can be put in. */
+static inline ht_mask_t ht_match_free(const signed char *ctrl)
+{
+	__m128i g = _mm_load_si128((const __m128i *)ctrl);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(HT_SENTINEL), g));
+}
+
+#else /* HT_GROUP_WIDTH == 8 */
+
+/* The same on a 64-bit word: cell i's bit is the top bit of byte i. */
+
+#define HT_MASK_INDEX(m) (__builtin_ctzll(m) >> 3)
+
+#define HT_LSBS 0x0101010101010101ULL
+#define HT_MSBS 0x8080808080808080ULL
+
+static inline unsigned long long ht_load(const signed char *ctrl)
+{
+	unsigned long long w;
+	memcpy(&w, ctrl, sizeof w);
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+/* This may also report a full cell just above a matching one; that
+   costs a comparison, but is otherwise harmless. */
+static inline ht_mask_t ht_match(const signed char *ctrl, signed char tag)
+{
+	unsigned long long x = ht_load(ctrl) ^ (HT_LSBS * (unsigned char)tag);
+	return (x - HT_LSBS) & ~x & HT_MSBS;
+}
+
+/* Empty is the only control byte with the top bit set and bit 1
+   clear... */
+static inline ht_mask_t ht_match_empty(const signed char *ctrl)
+{
+	unsigned long long w = ht_load(ctrl);
+	return w & ~(w << 6) & HT_MSBS;
+}
+
+/* ...and empty and deleted the only ones with it set and bit 0
+   clear. */
+static inline ht_mask_t ht_match_free(const signed char *ctrl)
+{
+	unsigned long long w = ht_load(ctrl);
+	return w & ~(w << 7) & HT_MSBS;
+}
+
+#endif /* HT_GROUP_WIDTH == 8 */
+
+#define HT_MASK_NEXT(m) ((m) &= (m) - 1)
+
+/* The smallest table size that is a power of two and at least SIZE. */
+static inline long ht_pow2_size(long size)
+{
+	long n = HT_MIN_SIZE;
+
+	while (n < size)
+	{
+		if (n > LONG_MAX / 2)
+			abort();
+		n <<= 1;
+	}
+	return n;
+}
+
+/* Allocate SIZE cells of CELL_SIZE bytes, followed by their control
+   bytes, all empty, and the sentinel.  *CTRL is set to the first
+   control byte. */
+static inline void *ht_alloc_cells(long size, size_t cell_size,
+								   signed char **ctrl)
+{
+	size_t bytes = size * cell_size + size + 1;
+	void *p;
+
+	/* The cells come first, so the control bytes are aligned as well as
+	   the allocation is. */
+#ifdef MADV_HUGEPAGE
+	/* A large array is filled in a random order, a few cells at a time
+	   during a resize, and every first touch of a small page is a page
+	   fault in the middle of some put.  Huge pages make those rare. */
+	if (bytes >= HT_HUGE_PAGE)
+	{
+		if (posix_memalign(&p, HT_HUGE_PAGE, bytes) != 0)
+			abort();
+		madvise(p, bytes, MADV_HUGEPAGE);
+	}
+	else
+#endif
+	if ((p = malloc(bytes)) == NULL)
+		abort();
+
+	*ctrl = (signed char *)p + size * cell_size;
+	memset(*ctrl, (unsigned char)HT_EMPTY, size);
+	(*ctrl)[size] = HT_SENTINEL;
+	return p;
+}
+
+/* The index of the first cell a key whose hash is HASH can be put in,
+   along its probe sequence in the array with control bytes CTRL, SIZE
+   large.  There always is one, since the array is never full. */
+static inline long ht_find_free(const signed char *ctrl, long size,
+								unsigned long hash)
+{
+	unsigned long groups = size / HT_GROUP_WIDTH;
+	unsigned long g = HT_GROUP(hash) & (groups - 1), step = 0;
+
+	for (;;)
+	{
+		ht_mask_t m = ht_match_free(ctrl + g * HT_GROUP_WIDTH);
+		if (m)
+			return g * HT_GROUP_WIDTH + HT_MASK_INDEX(m);
+
+		g = (g + ++step) & (groups - 1);
+	}
+}
+
+/* Removing the full cell I of an array with control bytes CTRL: a
+   search only goes past a group that has no empty cells, so if this
+   one has one, no key was put past it and the cell can be emptied.
+   Returns 1 if it was. */
+static inline int ht_clear_cell(signed char *ctrl, long i)
+{
+	if (ht_match_empty(ctrl + i / HT_GROUP_WIDTH * HT_GROUP_WIDTH))
+	{
+		ctrl[i] = HT_EMPTY;
+		return 1;
+	}
+	ctrl[i] = HT_DELETED;
+	return 0;
+}
+
+#define HTABLE_DEFINE(name, key_t, value_t, hash_fn, equal_fn)			\
+																		\
+struct name##_cell														\
+{																		\
+	key_t key;															\
+	value_t value;														\
+	unsigned long hash;													\
+};																		\
+																		\
+struct name																\
+{																		\
+	struct name##_cell *cells;											\
+	signed char *ctrl;													\
+	long size;															\
+	long count;			/* in both arrays */							\
+	long growth_left;	/* empty cells to fill before resizing */		\
+																		\
+	/* While resizing, the array the keys are being moved out of;		\
+	   those below old_pos have been.  NULL otherwise. */				\
+	struct name##_cell *old_cells;										\
+	signed char *old_ctrl;												\
+	long old_size;														\
+	long old_pos;														\
+};																		\
+																		\
+static inline unsigned long name##_hash(key_t key)						\
+{																		\
+	return hash_fn(key);												\
+}																		\
+																		\
+static inline void name##_alloc(struct name *t, long size)				\
+{																		\
+	t->cells = (struct name##_cell *)									\
+		ht_alloc_cells(size, sizeof(struct name##_cell), &t->ctrl);		\
+	t->size = size;														\
+	t->growth_left = HT_CAPACITY(size);									\
+}																		\
+																		\
+/* Make T empty, with room for ITEMS keys before it has to grow. */	\
+static inline void name##_init(struct name *t, long items)				\
+{																		\
+	name##_alloc(t, ht_pow2_size(1 + items / HT_MAX_FULLNESS));		\
+	t->count = 0;														\
+	t->old_cells = NULL;												\
+	t->old_ctrl = NULL;													\
+	t->old_size = t->old_pos = 0;										\
+}																		\
+																		\
+static inline void name##_destroy(struct name *t)						\
+{																		\
+	free(t->old_cells);													\
+	free(t->cells);														\
+}																		\
+																		\
+static inline long name##_count(const struct name *t)					\
+{																		\
+	return t->count;													\
+}																		\
+																		\
+static inline long name##_probe(const struct name##_cell *cells,		\
+								const signed char *ctrl,				\
+								long size,								\
+								key_t key,								\
+								unsigned long hash)						\
+{																		\
+	unsigned long groups = size / HT_GROUP_WIDTH;						\
+	unsigned long g = HT_GROUP(hash) & (groups - 1), step = 0;			\
+	signed char tag = HT_TAG(hash);										\
+																		\
+	for (;;)															\
+	{																	\
+		const signed char *gctrl = ctrl + g * HT_GROUP_WIDTH;			\
+		ht_mask_t m;													\
+																		\
+		__builtin_prefetch(cells + g * HT_GROUP_WIDTH);					\
+		m = ht_match(gctrl, tag);										\
+		for (; m; HT_MASK_NEXT(m))										\
+		{																\
+			long i = g * HT_GROUP_WIDTH + HT_MASK_INDEX(m);				\
+			if (cells[i].hash == hash && equal_fn(key, cells[i].key))	\
+				return i;												\
+		}																\
+		if (ht_match_empty(gctrl))										\
+			return -1;													\
+																		\
+		g = (g + ++step) & (groups - 1);								\
+	}																	\
+}																		\
+																		\
+/* The cell of KEY, whose hash is HASH, or NULL. */						\
+static inline struct name##_cell *name##_find(const struct name *t,	\
+											  key_t key,				\
+											  unsigned long hash)		\
+{																		\
+	long i = name##_probe(t->cells, t->ctrl, t->size, key, hash);		\
+																		\
+	if (i >= 0)															\
+		return t->cells + i;											\
+	if (t->old_cells)													\
+	{																	\
+		i = name##_probe(t->old_cells, t->old_ctrl, t->old_size,		\
+						 key, hash);									\
+		if (i >= 0)														\
+			return t->old_cells + i;									\
+	}																	\
+	return NULL;														\
+}																		\
+																		\
+static inline void name##_place(struct name *t,							\
+								const struct name##_cell *c)			\
+{																		\
+	long j = ht_find_free(t->ctrl, t->size, c->hash);					\
+																		\
+	if (t->ctrl[j] == HT_EMPTY)											\
+		--t->growth_left;												\
+	t->ctrl[j] = HT_TAG(c->hash);										\
+	t->cells[j] = *c;													\
+}																		\
+																		\
+/* Move the next N cells of the old array, if T is being resized. */	\
+static inline void name##_migrate(struct name *t, long n)				\
+{																		\
+	long i, end;														\
+																		\
+	if (!t->old_cells)													\
+		return;															\
+																		\
+	end = t->old_size - t->old_pos > n ? t->old_pos + n : t->old_size;	\
+	for (i = t->old_pos; i < end; i++)									\
+		if (HT_FULL(t->old_ctrl[i]))									\
+		{																\
+			name##_place(t, t->old_cells + i);							\
+			t->old_ctrl[i] = HT_DELETED;								\
+		}																\
+	t->old_pos = end;													\
+																		\
+	if (end == t->old_size)												\
+	{																	\
+		free(t->old_cells);												\
+		t->old_cells = NULL;											\
+		t->old_ctrl = NULL;												\
+	}																	\
+}																		\
+																		\
+static inline void name##_grow(struct name *t)							\
+{																		\
+	long newsize = t->size;												\
+																		\
+	name##_migrate(t, t->old_size);										\
+	if (t->count > HT_CAPACITY(t->size) / 2)							\
+		newsize = ht_pow2_size(t->size * HT_RESIZE_FACTOR);				\
+																		\
+	t->old_cells = t->cells;											\
+	t->old_ctrl = t->ctrl;												\
+	t->old_size = t->size;												\
+	t->old_pos = 0;														\
+	name##_alloc(t, newsize);											\
+}																		\
+																		\
+/* Move all the keys of T at once into a new array SIZE large. */		\
+static inline void name##_rehash_to(struct name *t, long size)			\
+{																		\
+	struct name##_cell *old_cells;										\
+	signed char *old_ctrl;												\
+	long old_size, i;													\
+																		\
+	name##_migrate(t, t->old_size);										\
+																		\
+	old_cells = t->cells;												\
+	old_ctrl = t->ctrl;													\
+	old_size = t->size;													\
+	name##_alloc(t, size);												\
+																		\
+	for (i = 0; i < old_size; i++)										\
+		if (HT_FULL(old_ctrl[i]))										\
+			name##_place(t, old_cells + i);								\
+																		\
+	free(old_cells);													\
+}																		\
+																		\
+/* Make room for ITEMS keys in all, so that T doesn't resize again		\
+   before it has as many.  This moves all the keys at once. */			\
+static inline void name##_reserve(struct name *t, long items)			\
+{																		\
+	long size;															\
+																		\
+	name##_migrate(t, t->old_size);										\
+	if (items - t->count <= t->growth_left)								\
+		return;															\
+																		\
+	size = ht_pow2_size(1 + items / HT_MAX_FULLNESS);					\
+	name##_rehash_to(t, size > t->size ? size : t->size);				\
+}																		\
+																		\
+/* Rehash T into the smallest array that holds ITEMS keys, or all it	\
+   has if that is more, dropping its tombstones. */						\
+static inline void name##_rehash(struct name *t, long items)			\
+{																		\
+	if (items < t->count)												\
+		items = t->count;												\
+	name##_rehash_to(t, ht_pow2_size(1 + items / HT_MAX_FULLNESS));		\
+}																		\
+																		\
+static inline struct name##_cell *name##_add(struct name *t,			\
+											 key_t key,					\
+											 unsigned long hash,		\
+											 value_t value)				\
+{																		\
+	struct name##_cell *c;												\
+	long i;																\
+																		\
+	i = ht_find_free(t->ctrl, t->size, hash);							\
+	if (t->ctrl[i] == HT_EMPTY && t->growth_left == 0)					\
+	{																	\
+		name##_grow(t);													\
+		i = ht_find_free(t->ctrl, t->size, hash);						\
+	}																	\
+																		\
+	if (t->ctrl[i] == HT_EMPTY)											\
+		--t->growth_left;												\
+	++t->count;															\
+	t->ctrl[i] = HT_TAG(hash);											\
+	c = t->cells + i;													\
+	c->key = key;														\
+	c->value = value;													\
+	c->hash = hash;														\
+	return c;															\
+}																		\
+																		\
+/* Add KEY, whose hash is HASH and which is not in T, with VALUE. */	\
+static inline struct name##_cell *name##_insert(struct name *t,		\
+												key_t key,				\
+												unsigned long hash,		\
+												value_t value)			\
+{																		\
+	name##_migrate(t, HT_MIGRATE_CELLS);								\
+	return name##_add(t, key, hash, value);								\
+}																		\
+																		\
+/* Store KEY's value in *VALUE and return 1, or return 0. */			\
+static inline int name##_get(const struct name *t,						\
+							 key_t key,									\
+							 value_t *value)							\
+{																		\
+	struct name##_cell *c = name##_find(t, key, name##_hash(key));		\
+																		\
+	if (c == NULL)														\
+		return 0;														\
+	*value = c->value;													\
+	return 1;															\
+}																		\
+																		\
+/* Map KEY, whose hash is HASH, to VALUE. */							\
+static inline void name##_put_hashed(struct name *t,					\
+									 key_t key,							\
+									 unsigned long hash,				\
+									 value_t value)						\
+{																		\
+	struct name##_cell *c;												\
+																		\
+	name##_migrate(t, HT_MIGRATE_CELLS);								\
+	c = name##_find(t, key, hash);										\
+	if (c)																\
+	{																	\
+		c->key = key;													\
+		c->value = value;												\
+	}																	\
+	else																\
+		name##_add(t, key, hash, value);								\
+}																		\
+																		\
+static inline void name##_put(struct name *t, key_t key, value_t value)	\
+{																		\
+	name##_put_hashed(t, key, name##_hash(key), value);					\
+}																		\
+																		\
+static inline int name##_remove(struct name *t, key_t key)				\
+{																		\
+	unsigned long hash = name##_hash(key);								\
+	long i;																\
+																		\
+	name##_migrate(t, HT_MIGRATE_CELLS);								\
+																		\
+	i = name##_probe(t->cells, t->ctrl, t->size, key, hash);			\
+	if (i >= 0)															\
+		t->growth_left += ht_clear_cell(t->ctrl, i);					\
+	else if (t->old_cells &&											\
+			 (i = name##_probe(t->old_cells, t->old_ctrl, t->old_size,	\
+							   key, hash)) >= 0)						\
+		t->old_ctrl[i] = HT_DELETED;									\
+	else																\
+		return 0;														\
+																		\
+	--t->count;															\
+	return 1;															\
+}
+
+#endif
@@ -9,8 +9,11 @@
 #include <ctype.h>
 #include <netdb.h>
 #include <regex.h>
+#include <poll.h>
+#include <fcntl.h>
 #include "http.h"
 #include "utils.h"
+#include "coro.h"
 
 
 #define SOCK_TIMEOUT 20
@@ -19,6 +22,49 @@
 
 #define HTTP_DEFAULT_PORT 80
 
+/* Becomes readable when pending I/O should be abandoned; -1 if none. */
+static int cancel_fd = -1;
+
+void http_set_cancel_fd(int fd)
+{
+	cancel_fd = fd;
+}
+
+/* Wait up to TIMEOUT seconds for EVENTS on FD.  Returns 0 when they
+   come, -1 with errno set on timeout or cancellation. */
+static int sock_wait(int fd, short events, double timeout)
+{
+	struct pollfd fds[2];
+	int res;
+
+	/* A coroutine lets the others run meanwhile. */
+	if (coro_running())
+		return coro_wait_fd(fd, events, timeout);
+
+	fds[0].fd = fd;
+	fds[0].events = events;
+	fds[1].fd = cancel_fd;
+	fds[1].events = POLLIN;
+
+	do
+		res = poll(fds, cancel_fd >= 0 ? 2 : 1, (int)(timeout * 1000));
+	while (res == -1 && errno == EINTR);
+
+	if (res < 0)
+		return -1;
+	if (cancel_fd >= 0 && fds[1].revents)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+	if (res == 0)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
+
 
 static int resp_header_locate(const response_t *resp, 
 		const char *name, int start, 
@@ -170,6 +216,9 @@ void resp_free(response_t *resp)
 static int sock_peek(int fd, char *buf, int bufsize, double timeout)
 {
 	int res;
+
+	if (sock_wait(fd, POLLIN, timeout) < 0)
+		return -1;
 	do
 		res = recv(fd, buf, bufsize, MSG_PEEK);
 	while (res == -1 && errno == EINTR);
@@ -179,6 +228,9 @@ static int sock_peek(int fd, char *buf, int bufsize, double timeout)
 static int sock_read(int fd, char *buf, int bufsize, double timeout)
 {
 	int res;
+
+	if (sock_wait(fd, POLLIN, timeout) < 0)
+		return -1;
 	do 
 		res = read(fd, buf, bufsize);
 	while (res == -1 && errno == EINTR);
@@ -289,12 +341,16 @@ char *read_http_resp_head(int fd)
 	}
 }
 
-int establish_connection(int *fd, char *url, int port)
+/* Look up the IPv4 address of HOST, for connect_address.  Returns 0,
+   or -1 if there is none.
+
+   This blocks the thread, and the resolver may need more stack than a
+   coroutine has, so coroutines are handed addresses looked up before
+   they start. */
+int resolve_host(const char *host, struct sockaddr_in *addr)
 {
-	int sock;
 	struct addrinfo hints, *result;
-	int ret;
-	
+
 	memset(&hints, 0, sizeof(struct addrinfo));
 
 	hints.ai_flags = AI_CANONNAME;
@@ -302,30 +358,64 @@ int establish_connection(int *fd, char *url, int port)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	if ((ret = getaddrinfo(url, "http", &hints, &result)))
+	if (getaddrinfo(host, "http", &hints, &result))
 	{
 		return -1;
 	}
 
+	memcpy(addr, result->ai_addr, sizeof(*addr));
+	freeaddrinfo(result);
+	return 0;
+}
+
+int connect_address(int *fd, const struct sockaddr_in *addr)
+{
+	int sock;
+	int flags, err;
+
 	if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 	{
 		perror("Can't create TCP socket!");
-		freeaddrinfo(result);
 		return -1;
 	}
 
-	if (connect(sock, result->ai_addr, result->ai_addrlen) < 0)
+	/* Connect without blocking so that the wait can be timed out or
+	   cancelled. */
+	flags = fcntl(sock, F_GETFL);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+	if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
 	{
-		perror("Could not connect");
-		freeaddrinfo(result);
-		return -1;
+		socklen_t len = sizeof(err);
+
+		if (errno != EINPROGRESS ||
+			sock_wait(sock, POLLOUT, SOCK_TIMEOUT) < 0 ||
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+			(err && (errno = err)))
+		{
+			if (errno != ECANCELED)
+				perror("Could not connect");
+			close(sock);
+			return -1;
+		}
 	}
+
+	fcntl(sock, F_SETFL, flags);
 	
 	*fd = sock;
-	freeaddrinfo(result);	
 	return 0;
 }
 
+int establish_connection(int *fd, char *url, int port)
+{
+	struct sockaddr_in addr;
+
+	if (resolve_host(url, &addr) < 0)
+		return -1;
+
+	return connect_address(fd, &addr);
+}
+
 /*
 
 int establish_connection(int *fd, char *url, int port)
@@ -398,7 +488,7 @@ int send_request(int fd, url_t *u)
 int read_resp_body(int fd, long toread, char *buf)
 {
 	long sum_read = 0;
-	int ret;
+	int ret = 0;
 
 	while (sum_read < toread)
 	{
@@ -1,5 +1,6 @@
 #ifndef _HTTP_H
 #define _HTTP_H
+#include <netinet/in.h>
 #include "url.h"
 
 typedef struct http_header
@@ -22,9 +23,26 @@ typedef struct response{
 }response_t;
 
 
+extern void http_set_cancel_fd(int fd);
+
 extern int establish_connection();
 
+extern int resolve_host(const char *host, struct sockaddr_in *addr);
+
+extern int connect_address(int *fd, const struct sockaddr_in *addr);
+
 extern int send_request(int fd, url_t *u);
 
 extern int read_resp_body(int fd, long toread, char *buf);
+
+extern char *read_http_resp_head(int fd);
+
+extern response_t *resp_new(const char *head);
+
+extern void resp_free(response_t *resp);
+
+extern int resp_status(const response_t *resp);
+
+extern int resp_header_copy(const response_t *resp,
+		const char *name, char *buf, int bufsize);
 #endif
@@ -3,49 +3,499 @@
 #include <pthread.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "threadpool.h"
 #include "http.h"
 #include "url.h"
 #include "hash.h"
 #include "webgraph.h"
+#include "frontier.h"
+#include "utils.h"
+#include "checkpoint.h"
+#include "throttle.h"
+#include "stage.h"
+#include "coro.h"
 
 #define NUM_THREADS 200
 
-#define SETBIT(a, n) (a[n/CHAR_BIT] |= (1<<(n%CHAR_BIT)))
-#define CLRBIT(a, n) (a[n/CHAR_BIT] &= ~(1<<(n%CHAR_BIT)))
-#define GETBIT(a, n) (a[n/CHAR_BIT] & (1<<(n%CHAR_BIT)))
+/* Fetches allowed in flight when the crawl starts. */
+#define MIN_FETCHES 4
 
+#define FRONTIER_CAPACITY 65536
 
-static struct url_queue *queue = NULL; 
+#define FRONTIER_SPILL_DIR "frontier.spill"
+
+/* URLs the web graph and its seen-set filter are sized for without a
+   page budget, and per page of the budget with one. */
+#define GRAPH_SIZE 500000
+
+#define GRAPH_URLS_PER_PAGE 16
+
+/* Back queues per worker; more than one lets the next hosts line up
+   while the current ones are resting. */
+#define BACK_QUEUES_PER_THREAD 3
+
+#define CHECKPOINT_DIR "crawl.checkpoint"
+
+/* Seconds between checkpoints. */
+#define CHECKPOINT_INTERVAL 300
+
+/* Pages each pipeline stage can have waiting. */
+#define STAGE_QUEUE 256
+
+/* Threads of the graph stage; it is mostly waiting for the graph
+   lock, so more do not help. */
+#define GRAPH_STAGE_THREADS 2
+
+/* Coroutine mode: scheduler threads, and the stack of each fetch
+   coroutine. */
+#define CORO_THREADS 4
+
+#define CORO_STACK_SIZE (64 * 1024)
+
+/* How long a scheduler that ran out of memory waits to try again. */
+#define CORO_RETRY_WAIT 0.1
+
+/* Coroutine mode: threads looking up hosts for the fetch coroutines,
+   and how long a coroutine waits for a lookup. */
+#define DNS_STAGE_THREADS 8
+
+#define DNS_TIMEOUT 20.0
+
+/* Seconds in-flight fetches get to finish when the crawl is stopped,
+   before they are cancelled. */
+#define DRAIN_TIMEOUT 1.0
+
+/* Depths tracked individually; deeper pages share the last slot. */
+#define CRAWL_DEPTH_SLOTS 64
+
+
+
+static struct frontier *frontier = NULL; 
+
+/* Stop after this many pages; 0 means no limit. */
+static long page_budget = 0;
+
+static long pages_fetched = 0;
+
+/* URLs expected to be seen; 0 derives it from the page budget. */
+static long graph_size = 0;
+
+/* Politeness: concurrent connections per host, and how long a host
+   rests after a fetch, as a multiple of that fetch's duration. */
+static int max_per_host = 4;
+
+static double delay_factor = 1.0;
+
+/* Depth bound; the seed is at depth 1 and 0 means no bound. */
+static int max_depth = 0;
+
+/* Pages to fetch at each depth; 0 means no limit. */
+static long depth_limit[CRAWL_DEPTH_SLOTS];
+
+static long fetched_at_depth[CRAWL_DEPTH_SLOTS];
+
+static long discovered_at_depth[CRAWL_DEPTH_SLOTS];
+
+#define DEPTH_SLOT(d) ((d) < CRAWL_DEPTH_SLOTS ? (d) : CRAWL_DEPTH_SLOTS - 1)
+
+/* Whether links found at DEPTH can still be fetched. */
+static int depth_open(int depth)
+{
+	long limit;
+
+	if (max_depth && depth > max_depth)
+		return 0;
+
+	limit = depth_limit[DEPTH_SLOT(depth)];
+	return limit == 0 ||
+		__atomic_load_n(&fetched_at_depth[DEPTH_SLOT(depth)],
+						__ATOMIC_RELAXED) < limit;
+}
+
+/* Claim a fetch slot at DEPTH; 0 if that depth is used up. */
+static int depth_reserve(int depth)
+{
+	long *count = &fetched_at_depth[DEPTH_SLOT(depth)];
+	long limit = depth_limit[DEPTH_SLOT(depth)];
+
+	if (__atomic_fetch_add(count, 1, __ATOMIC_RELAXED) < limit || limit == 0)
+		return 1;
+
+	__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Parse "n1,n2,..." as the fetch limits of depths 1, 2, ... */
+static void parse_depth_limits(char *list)
+{
+	char *tok;
+	int depth = 1;
+
+	for (tok = strtok(list, ","); tok && depth < CRAWL_DEPTH_SLOTS;
+		 tok = strtok(NULL, ","))
+		depth_limit[depth++] = strtol(tok, NULL, 10);
+}
+
+static void print_depth_stats(void)
+{
+	int d;
+
+	printf("depth  discovered  fetched\n");
+	for (d = 1; d < CRAWL_DEPTH_SLOTS; d++)
+		if (discovered_at_depth[d] || fetched_at_depth[d])
+			printf("%5d  %10ld  %7ld\n", d,
+				   discovered_at_depth[d], fetched_at_depth[d]);
+}
+
+/* Checkpointing: where, how often (0 disables it), and the manifest
+   of the last checkpoint taken. */
+static const char *checkpoint_dir = CHECKPOINT_DIR;
+
+static int checkpoint_interval = CHECKPOINT_INTERVAL;
+
+static struct checkpoint_manifest manifest;
+
+/* Held shared by workers from recording a page's links until they are
+   queued and the page is released, and exclusively while a checkpoint
+   captures the graph and frontier, so that every captured node has its
+   page state too. */
+static pthread_rwlock_t crawl_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Bounds on the fetches in flight; the throttle picks the number in
+   between as the crawl goes, from latency and error rate. */
+static int min_fetches = MIN_FETCHES;
+
+static int max_fetches = NUM_THREADS;
+
+static struct throttle *throttle;
+
+/* Fetches as coroutines instead of one per pool thread: how many at
+   most (0 runs the threaded crawl), on how many threads. */
+static int coroutines = 0;
+
+static int coro_threads = CORO_THREADS;
 
 static threadpool pool;
 
+/* What each pool thread keeps to itself: its share of the
+   statistics, summed up as the thread exits. */
+struct crawl_context
+{
+	long pages;
+	long bytes;
+	long errors;
+};
+
+static long total_pages, total_bytes, total_errors;
+
+static void *crawl_context_new(int index, void *arg)
+{
+	return calloc(1, sizeof(struct crawl_context));
+}
+
+static void crawl_context_delete(void *context)
+{
+	struct crawl_context *ctx = (struct crawl_context *)context;
+
+	if (ctx == NULL)
+		return;
+
+	__atomic_add_fetch(&total_pages, ctx->pages, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&total_bytes, ctx->bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&total_errors, ctx->errors, __ATOMIC_RELAXED);
+
+	free(ctx);
+}
+
 static webgraph_handle graph;
 
-static struct
+/* Crawl loops still running; main waits on done_cond for zero, or
+   for stop_requested. */
+static int workers_running = 0;
+
+static int stop_requested = 0;
+
+static double drain_timeout = DRAIN_TIMEOUT;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t done_cond;
+
+/*
+ * A page goes through four stages.  Pool threads fetch it; the extract
+ * stage pulls the links out of its body; the resolve stage makes them
+ * absolute, drops the bad ones and fingerprints the rest; the graph
+ * stage records them, queues the new pages and releases the page.
+ * Extract and resolve only use the CPU and can be pinned to cores.
+ * Pages without links to follow are released by their fetcher.
+ */
+struct page_job
+{
+	struct url_entry entry;
+	int host;
+	double elapsed;		/* fetch time, for politeness */
+	char *url;
+	url_fp_t fp;
+	char *body;
+	struct url_vec *found;
+	struct webgraph_link *links;
+	int num_links;
+};
+
+/* Threads per stage, and the first core to pin the CPU-bound stages
+   to; -1 leaves them unpinned. */
+static int extract_threads = 0;
+
+static int resolve_threads = 0;
+
+static int graph_threads = GRAPH_STAGE_THREADS;
+
+static int pin_cpu = -1;
+
+static struct stage *extract_stage, *resolve_stage, *graph_stage;
+
+/* Coroutine mode only. */
+static struct stage *dns_stage;
+
+static void extract_links(void *item, void *arg)
 {
-	char queue_empty[NUM_THREADS / CHAR_BIT + 1];
-	pthread_mutex_t f_lock;
-}flag = {{0}, PTHREAD_MUTEX_INITIALIZER};
+	struct page_job *job = (struct page_job *)item;
+
+	job->found = extract_urls(job->body);
+	free(job->body);
+	job->body = NULL;
 
-static int check_exit()
+	stage_put(resolve_stage, job);
+}
+
+static void resolve_links(void *item, void *arg)
 {
+	struct page_job *job = (struct page_job *)item;
+	struct url_vec *vec;
+	int n = 0;
+
+	for (vec = job->found; vec; vec = vec->next)
+		n++;
+
+	job->links = (struct webgraph_link *)
+		malloc((n + 1) * sizeof(struct webgraph_link));
+
+	for (vec = job->found; vec; vec = vec->next)
+	{
+		char *url_merged = uri_merge(job->url, vec->url);
+
+		url_simplify(url_merged);
+
+		if (url_sanity_check(url_merged))
+		{
+			job->links[job->num_links].url = url_merged;
+			job->links[job->num_links].fp = url_fingerprint(url_merged);
+			job->num_links++;
+		}
+		else
+		{
+			free(url_merged);
+		}
+	}
+	free_url_vec(job->found);
+	job->found = NULL;
+
+	stage_put(graph_stage, job);
+}
+
+/* Record and queue the page's links with one call each.  The page is
+   released only then, so the frontier does not run dry while its
+   links are on their way. */
+static void insert_links(void *item, void *arg)
+{
+	struct page_job *job = (struct page_job *)item;
+	long *new_ids;
+	int num_new = 0;
 	int i;
-	int exit = 1;
-	
-	pthread_mutex_lock(&flag.f_lock);
 
-	for (i = 0; i < NUM_THREADS; i++)
-		if (GETBIT(flag.queue_empty, i) == 0)
-			exit = 0;
+	new_ids = (long *)malloc((job->num_links + 1) * sizeof(long));
+
+	pthread_rwlock_rdlock(&crawl_lock);
+
+	if (webgraph_add_links(graph, job->url, job->fp,
+						   job->links, job->num_links) < 0)
+		fprintf(stderr, "Failed to record the links of %s!\n", job->url);
+
+	for (i = 0; i < job->num_links; i++)
+	{
+		if (job->links[i].is_new)
+			new_ids[num_new++] = job->links[i].id;
+		free((char *)job->links[i].url);
+	}
+
+	frontier_push_batch(frontier, new_ids, num_new,
+						job->entry.id, job->entry.depth + 1);
+
+	/* Still under the lock: a checkpoint that has the page's links must
+	   have it fetched too, or a resumed crawl adds them again. */
+	frontier_release(frontier, job->host, job->entry.id, job->elapsed);
+
+	pthread_rwlock_unlock(&crawl_lock);
+	__atomic_add_fetch(&discovered_at_depth[DEPTH_SLOT(job->entry.depth + 1)],
+					   num_new, __ATOMIC_RELAXED);
+
+	free(new_ids);
+	free(job->links);
+	free(job->url);
+	free(job);
+}
+
+static void print_stage_stats(void)
+{
+	stage_print_stats_header();
+	stage_print_stats(extract_stage);
+	stage_print_stats(resolve_stage);
+	stage_print_stats(graph_stage);
+	if (dns_stage)
+		stage_print_stats(dns_stage);
+}
+
+/* Ask main to wind the crawl down. */
+static void request_stop(void)
+{
+	pthread_mutex_lock(&done_lock);
+	stop_requested = 1;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+}
+
+/* A page taken from the frontier, holding a throttle slot and a
+   budget slot. */
+struct fetch_job
+{
+	struct url_entry entry;
+	int host;
+	char *url;		/* NULL: nothing to fetch, only release */
+	double start;
+};
+
+/* Take a page from the frontier, waiting for one if WAIT is NULL.
+   Returns 1 with FJ filled in, -1 once the crawl is over (or the
+   budget is spent), or, with WAIT, 0 if no page is ready; then *WAIT
+   is as for frontier_try_pop.  The throttle slot is the caller's. */
+static int take_page(struct fetch_job *fj, double *wait)
+{
+	int ret;
+
+	/* Reserve a slot in the page budget before taking a URL. */
+	if (page_budget &&
+		__atomic_fetch_add(&pages_fetched, 1, __ATOMIC_RELAXED) >= page_budget)
+	{
+		__atomic_sub_fetch(&pages_fetched, 1, __ATOMIC_RELAXED);
+		request_stop();
+		return -1;
+	}
+
+	if (wait)
+		ret = frontier_try_pop(frontier, &fj->entry, &fj->host, wait);
+	else
+		ret = frontier_pop(frontier, &fj->entry, &fj->host) ? 1 : -1;
+
+	if (ret <= 0)
+	{
+		if (page_budget)
+			__atomic_sub_fetch(&pages_fetched, 1, __ATOMIC_RELAXED);
+		return ret;
+	}
+
+	fj->start = now_seconds();
+	fj->url = webgraph_get_url(graph, fj->entry.id);
+
+	if (fj->url && !depth_reserve(fj->entry.depth))
+	{
+		/* This depth is full; the page is dropped, not retried. */
+		if (page_budget)
+			__atomic_sub_fetch(&pages_fetched, 1, __ATOMIC_RELAXED);
+		free(fj->url);
+		fj->url = NULL;
+	}
+
+	return 1;
+}
+
+/* A host lookup for a fetch coroutine.  It is done on the dns stage:
+   the resolver blocks the thread, and may need more stack than a
+   coroutine has.  The coroutine and the stage hold a reference each,
+   since a cancelled coroutine does not wait for the lookup to end. */
+struct dns_job
+{
+	char *host;
+	struct sockaddr_in addr;
+	int result;
+	int done;
+	int refs;
+	struct coro *coro;
+};
+
+static void dns_job_unref(struct dns_job *job)
+{
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		free(job->host);
+		free(job);
+	}
+}
 
-	pthread_mutex_unlock(&flag.f_lock);
+static void lookup_host(void *item, void *arg)
+{
+	struct dns_job *job = (struct dns_job *)item;
 
-	return exit;
+	job->result = resolve_host(job->host, &job->addr);
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	coro_wake(job->coro);
+	dns_job_unref(job);
 }
 
-void retrieve_webpage(void *arg)
+/* resolve_host for a coroutine: only the coroutine waits for the
+   lookup, while the others go on running. */
+static int resolve_in_stage(const char *host, struct sockaddr_in *addr)
+{
+	struct dns_job *job;
+	int ret = -1;
+
+	job = (struct dns_job *)calloc(1, sizeof(struct dns_job));
+	if (job == NULL || (job->host = strdup(host)) == NULL)
+	{
+		free(job);
+		return -1;
+	}
+	job->refs = 2;
+	job->coro = coro_self();
+
+	stage_put(dns_stage, job);
+
+	while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+		if (coro_park(DNS_TIMEOUT) < 0)
+			break;
+
+	if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) && job->result == 0)
+	{
+		*addr = job->addr;
+		ret = 0;
+	}
+
+	dns_job_unref(job);
+	return ret;
+}
+
+/* Fetch the page of FJ and hand it to the extract stage, or release
+   it; then give back its throttle slot.  This is plain blocking code:
+   on a pool thread it blocks the thread, in a coroutine only the
+   coroutine. */
+static void fetch_page(struct fetch_job *fj)
 {
 	char *head = NULL;
 	char header_val[256];
@@ -53,45 +503,34 @@ void retrieve_webpage(void *arg)
 	int statcode;
 	long content_length;
 	int fd = -1;
+	struct sockaddr_in addr;
 	int ret;
 	
 	int count;
 
-	char *url = NULL;
-	char *referer = NULL;
+	char *url = fj->url;
+	struct url_entry entry = fj->entry;
+	url_fp_t url_fp;
 	char *content_buf = NULL;
+	struct page_job *job;
+	struct crawl_context *ctx = (struct crawl_context *)worker_context();
 
 	url_t *u = NULL;
 
-	int depth;
 	int parse_error;
-	
-	pthread_t self;
-	int thread_id;
-	
-	int exit = 0;
-
-	self = pthread_self();	
-	thread_id = get_thread_id(pool, self);
 
-	ret = url_dequeue(queue, &url, &referer, &depth);
+	int host_slot = fj->host;
+	double fetch_start = fj->start;
+	double fetch_time = -1.0;
+	int fetch_error = 0;
+	int finished = 0;
 
 	if (url == NULL)
-	{
-		pthread_mutex_lock(&flag.f_lock);
-		SETBIT(flag.queue_empty, thread_id);
-		pthread_mutex_unlock(&flag.f_lock);
-
-		exit = check_exit();
-						
 		goto cleanup;
-	}
 
-	pthread_mutex_lock(&flag.f_lock);
-	CLRBIT(flag.queue_empty, thread_id);
-	pthread_mutex_unlock(&flag.f_lock);
+	url_fp = url_fingerprint(url);
 
-	count = url_get_queue_count(queue);
+	count = frontier_count(frontier);
 
 	printf("From URL: %s, remains: %d\n", url, count);	
 
@@ -104,17 +543,37 @@ void retrieve_webpage(void *arg)
 	}
 		
 
-	ret = establish_connection(&fd, u->host, u->port);
+	if (coro_running())
+		ret = resolve_in_stage(u->host, &addr) < 0 ? -1 :
+			connect_address(&fd, &addr);
+	else
+		ret = establish_connection(&fd, u->host, u->port);
 
 	if (ret < 0) 
+	{
+		fetch_time = now_seconds() - fetch_start;
+		fetch_error = 1;
 		goto cleanup;	
+	}
 
 	ret = send_request(fd, u);
-	head = read_http_resp_head(fd);
+	head = ret < 0 ? NULL : read_http_resp_head(fd);
+
+	/* Timed out, cancelled or closed on us. */
+	if (head == NULL)
+	{
+		fetch_time = now_seconds() - fetch_start;
+		fetch_error = 1;
+		goto cleanup;
+	}
 	
 	resp = resp_new(head);
 	statcode = resp_status(resp);
 	printf("status code: %d\n", statcode);
+
+	/* Overload shows up as server errors and "Too Many Requests". */
+	fetch_time = now_seconds() - fetch_start;
+	fetch_error = statcode <= 0 || statcode >= 500 || statcode == 429;
 	
 	if (statcode != 200)
 		goto cleanup;	
@@ -145,45 +604,42 @@ void retrieve_webpage(void *arg)
 		goto cleanup;
 	}
 
-	read_resp_body(fd, content_length, content_buf);
-		
+	/* A body cut short by a drain or cancel is not the page: leave it
+	   unfinished, so that a cancel queues it again. */
+	if (read_resp_body(fd, content_length, content_buf) < 0 ||
+		worker_cancelled())
 	{
-		struct url_vec *vec_head = NULL;
-		struct url_vec *vec_tail = NULL;
-		char *url_merged         = NULL;	
-		url_t *url_parsed        = NULL;
-
-		vec_head = extract_urls(content_buf);
-		vec_tail = vec_head;
+		fetch_error = 1;
+		goto cleanup;
+	}
+	ctx->pages++;
+	ctx->bytes += content_length;
 
-		for (; vec_tail; vec_tail = vec_tail->next)
-		{
-			url_merged = uri_merge(url, vec_tail->url);
-	
-			url_simplify(url_merged);
-	
-			if (url_sanity_check(url_merged))
-			{
-				if (webgraph_contains(graph, url_merged))
-				{
-					webgraph_add_link(graph, url_merged, url);
+	/* Links past the depth bound never reach the seen-set. */
+	if (!depth_open(entry.depth + 1))
+		goto cleanup;
 
-					free(url_merged);
-					continue;
-				}
+	job = (struct page_job *)calloc(1, sizeof(struct page_job));
 
-				webgraph_add_url(graph, url_merged);	
-				webgraph_add_link(graph, url_merged, url);
-				url_enqueue(queue, url_merged, NULL, NULL); 
-			}
-			else
-			{
-				free(url_merged);
-			}
-		}
-		free_url_vec(vec_head);	
+	if (job == NULL)
+	{
+		perror("Failed to allocate page job!");
+		goto cleanup;
 	}
-	free(content_buf);	
+
+	/* From here on the page belongs to the pipeline. */
+	job->entry = entry;
+	job->host = host_slot;
+	job->elapsed = now_seconds() - fetch_start;
+	job->url = url;
+	job->fp = url_fp;
+	job->body = content_buf;
+	url = NULL;
+	content_buf = NULL;
+	host_slot = -1;
+
+	stage_put(extract_stage, job);
+	finished = 1;
 cleanup:
 	if (fd > 0)
 		close(fd);
@@ -196,10 +652,293 @@ cleanup:
 		resp_free(resp);
 	if (url)
 		free(url);
-	if (referer)
-		free(referer);
-	if (exit)
-		pthread_exit(NULL);
+	if (content_buf)
+		free(content_buf);
+	if (host_slot >= 0 && !finished && worker_cancelled())
+	{
+		/* Cut short: the page stays unreleased, so that a checkpoint
+		   queues it again, and its budget slot is given back. */
+		if (page_budget)
+			__atomic_sub_fetch(&pages_fetched, 1, __ATOMIC_RELAXED);
+		fetch_time = -1.0;
+		fetch_error = 0;
+	}
+	else if (host_slot >= 0)
+		frontier_release(frontier, host_slot, entry.id,
+						 now_seconds() - fetch_start);
+
+	if (fetch_error)
+		ctx->errors++;
+	throttle_release(throttle, fetch_time, fetch_error);
+}
+
+/* Fetch one page on this thread.  Blocks until a page is ready;
+   returns 0 once the crawl is over (or the budget is spent). */
+static int retrieve_webpage(void)
+{
+	struct fetch_job fj;
+
+	throttle_acquire(throttle);
+
+	if (take_page(&fj, NULL) < 0)
+	{
+		throttle_release(throttle, -1.0, 0);
+		return 0;
+	}
+
+	fetch_page(&fj);
+	return 1;
+}
+
+/* A pool task: pull pages from the frontier until there are none. */
+static void crawl_worker(void *arg)
+{
+	while (worker_continue() && retrieve_webpage())
+		;
+
+	pthread_mutex_lock(&done_lock);
+	if (--workers_running == 0)
+		pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+}
+/* The coroutine schedulers, one per pool thread.  They are deleted
+   only once the crawl is over, so that wake_schedulers never sees one
+   go. */
+static struct coro_sched **scheds;
+
+static int nscheds;
+
+/* Frontier wake hook in coroutine mode: have every scheduler look for
+   pages to start again. */
+static void wake_schedulers(void *arg)
+{
+	int n = __atomic_load_n(&nscheds, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < n && i < coro_threads; i++)
+	{
+		struct coro_sched *s = __atomic_load_n(&scheds[i], __ATOMIC_ACQUIRE);
+
+		if (s)
+			coro_sched_wake(s);
+	}
+}
+
+static void fetch_coroutine(void *arg)
+{
+	struct fetch_job *fj = (struct fetch_job *)arg;
+
+	fetch_page(fj);
+	free(fj);
+
+	/* Its throttle slot is free for another page. */
+	wake_schedulers(NULL);
+}
+
+/* A pool task in coroutine mode: start a coroutine per page, as far as
+   the throttle and this thread's share of the coroutines allow, and
+   run them until the crawl is over.  With nothing to start it sleeps
+   until the frontier or a finished fetch wakes it, or until the next
+   host is ready. */
+static void coro_crawl_worker(void *arg)
+{
+	int per_thread = (coroutines + coro_threads - 1) / coro_threads;
+	struct coro_sched *sched;
+	struct fetch_job *fj = NULL;
+	int admitting = 1;
+	double wait;
+	int ret, slot;
+
+	sched = coro_sched_new(CORO_STACK_SIZE, get_cancel_fd(pool));
+	if (sched == NULL)
+		fprintf(stderr, "Failed to start a coroutine scheduler!\n");
+	else
+	{
+		slot = __atomic_fetch_add(&nscheds, 1, __ATOMIC_ACQ_REL);
+		__atomic_store_n(&scheds[slot], sched, __ATOMIC_RELEASE);
+	}
+
+	while (sched)
+	{
+		wait = -1.0;
+
+		if (admitting && !worker_continue())
+			admitting = 0;
+
+		while (admitting && coro_count(sched) < per_thread)
+		{
+			if (fj == NULL &&
+				(fj = (struct fetch_job *)malloc(sizeof(*fj))) == NULL)
+			{
+				wait = CORO_RETRY_WAIT;
+				break;
+			}
+
+			if (!throttle_try_acquire(throttle))
+				break;
+
+			if ((ret = take_page(fj, &wait)) <= 0)
+			{
+				throttle_release(throttle, -1.0, 0);
+				if (ret < 0)
+					admitting = 0;
+				break;
+			}
+
+			if (coro_spawn(sched, fetch_coroutine, fj) < 0)
+				fetch_coroutine(fj);
+			fj = NULL;
+		}
+
+		if (!admitting && coro_count(sched) == 0)
+			break;
+
+		coro_run(sched, wait);
+	}
+
+	free(fj);
+
+	pthread_mutex_lock(&done_lock);
+	if (--workers_running == 0)
+		pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+}
+
+/* Every fetch coroutine holds a socket. */
+static void raise_fd_limit(long needed)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= (rlim_t)needed)
+		return;
+
+	rl.rlim_cur = rl.rlim_max == RLIM_INFINITY ||
+		rl.rlim_max >= (rlim_t)needed ? (rlim_t)needed : rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < (rlim_t)needed)
+		fprintf(stderr, "Only %ld file descriptors for %ld fetches!\n",
+				(long)rl.rlim_cur, needed);
+}
+
+/* Signals are taken here rather than in handlers: SIGINT and SIGTERM
+   stop the crawl, a second one cancels the fetches still running, and
+   SIGUSR1 pauses and resumes it. */
+static sigset_t crawl_signals;
+
+static void *signal_thread(void *arg)
+{
+	int sig;
+	int stops = 0;
+	int paused = 0;
+	int ret;
+
+	/* main cancels us before the pool goes away; only while we are
+	   waiting for a signal. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;)
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = sigwait(&crawl_signals, &sig);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ret != 0)
+			continue;
+
+		if (sig == SIGUSR1)
+		{
+			paused = !paused;
+			if (paused)
+				pause_threadpool(pool);
+			else
+				resume_threadpool(pool);
+			printf("Crawl %s.\n", paused ? "paused" : "resumed");
+		}
+		else if (stops++ == 0)
+		{
+			printf("Stopping the crawl; interrupt again to cancel "
+				   "fetches in progress.\n");
+			request_stop();
+		}
+		else
+			cancel_threadpool(pool);
+	}
+
+	return NULL;
+}
+
+
+/* Save the crawl state.  Only the capture runs with the workers held
+   off; encoding and writing happen while they go on crawling. */
+static void take_checkpoint(void)
+{
+	struct webgraph_checkpoint *gcp;
+	struct frontier_checkpoint *fcp;
+	struct checkpoint_manifest next = manifest;
+	double start = now_seconds();
+	int committed = 1;
+
+	pthread_rwlock_wrlock(&crawl_lock);
+	gcp = webgraph_checkpoint_begin(graph);
+	fcp = frontier_checkpoint_begin(frontier);
+	pthread_rwlock_unlock(&crawl_lock);
+
+	memcpy(next.magic, CHECKPOINT_MAGIC, sizeof(next.magic));
+	if (manifest.nodes || manifest.links || manifest.states)
+		next.generation++;
+	next.pages_fetched = __atomic_load_n(&pages_fetched, __ATOMIC_RELAXED);
+
+	/* The state file is not used until the manifest names it. */
+	if (frontier_checkpoint_write(frontier, fcp, checkpoint_dir, &next) < 0)
+		committed = 0;
+
+	if (webgraph_checkpoint_write(graph, gcp, checkpoint_dir, &next) < 0)
+	{
+		/* The graph delta is gone; later checkpoints would miss it. */
+		fprintf(stderr, "Checkpoint failed, checkpointing disabled!\n");
+		checkpoint_interval = 0;
+		return;
+	}
+
+	if (!committed || checkpoint_commit(checkpoint_dir, &next) < 0)
+	{
+		/* The appended graph data stays; the next commit covers it. */
+		fprintf(stderr, "Checkpoint %llu not committed!\n",
+				(unsigned long long)next.generation);
+		manifest.nodes = next.nodes;
+		manifest.links = next.links;
+		manifest.string_bytes = next.string_bytes;
+		return;
+	}
+
+	manifest = next;
+	printf("Checkpoint %llu: %llu pages, %llu links, %.3fs\n",
+		   (unsigned long long)manifest.generation,
+		   (unsigned long long)manifest.nodes,
+		   (unsigned long long)manifest.links, now_seconds() - start);
+}
+
+/* Reload the last checkpoint into the empty graph and frontier. */
+static int resume_crawl(void)
+{
+	if (checkpoint_read_manifest(checkpoint_dir, &manifest) < 0)
+	{
+		fprintf(stderr, "No checkpoint to resume in %s!\n", checkpoint_dir);
+		return -1;
+	}
+
+	if (webgraph_restore(graph, checkpoint_dir, &manifest) < 0 ||
+		frontier_restore(frontier, checkpoint_dir, &manifest) < 0)
+	{
+		fprintf(stderr, "Failed to restore checkpoint %llu!\n",
+				(unsigned long long)manifest.generation);
+		return -1;
+	}
+
+	pages_fetched = manifest.pages_fetched;
+
+	printf("Resumed checkpoint %llu: %llu pages, %d queued\n",
+		   (unsigned long long)manifest.generation,
+		   (unsigned long long)manifest.nodes, frontier_count(frontier));
+	return 0;
 }
 
 
@@ -208,23 +947,180 @@ int main(int argc, char *argv[])
 	const char *seed_url = "http://10.108.106.36/pcourse/index.html";
 	int depth = 1;
 
-	char *url = NULL;
-	char *referer = NULL;
+	long seed_id;
+	int added;
+	int opt;
+	int resume = 0;
+	int i;
+	double last_checkpoint;
+	pthread_condattr_t attr;
+	pthread_t signal_tid;
+	int nworkers;
+
+	static const struct option long_options[] =
+	{
+		{"max-pages",           required_argument, NULL, 'n'},
+		{"conns-per-host",      required_argument, NULL, 'c'},
+		{"delay-factor",        required_argument, NULL, 'd'},
+		{"max-depth",           required_argument, NULL, 'D'},
+		{"depth-limits",        required_argument, NULL, 'l'},
+		{"checkpoint-dir",      required_argument, NULL, 'C'},
+		{"checkpoint-interval", required_argument, NULL, 'i'},
+		{"resume",              no_argument,       NULL, 'r'},
+		{"min-fetches",         required_argument, NULL, 'm'},
+		{"max-fetches",         required_argument, NULL, 'M'},
+		{"drain-timeout",       required_argument, NULL, 'T'},
+		{"stage-threads",       required_argument, NULL, 'S'},
+		{"pin-cpus",            required_argument, NULL, 'p'},
+		{"coroutines",          required_argument, NULL, 'k'},
+		{"coro-threads",        required_argument, NULL, 'K'},
+		{"graph-size",          required_argument, NULL, 'g'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "n:c:d:D:l:C:i:rm:M:T:S:p:k:K:g:",
+							  long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			page_budget = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			max_per_host = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			delay_factor = strtod(optarg, NULL);
+			break;
+		case 'D':
+			max_depth = strtol(optarg, NULL, 10);
+			break;
+		case 'l':
+			parse_depth_limits(optarg);
+			break;
+		case 'C':
+			checkpoint_dir = optarg;
+			break;
+		case 'i':
+			checkpoint_interval = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 'm':
+			min_fetches = strtol(optarg, NULL, 10);
+			break;
+		case 'M':
+			max_fetches = strtol(optarg, NULL, 10);
+			break;
+		case 'T':
+			drain_timeout = strtod(optarg, NULL);
+			break;
+		case 'S':
+			sscanf(optarg, "%d,%d,%d", &extract_threads, &resolve_threads,
+				   &graph_threads);
+			break;
+		case 'p':
+			pin_cpu = strtol(optarg, NULL, 10);
+			break;
+		case 'k':
+			coroutines = strtol(optarg, NULL, 10);
+			break;
+		case 'K':
+			coro_threads = strtol(optarg, NULL, 10);
+			break;
+		case 'g':
+			graph_size = strtol(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n max_pages] [-c conns_per_host] "
+					"[-d delay_factor] [-D max_depth] "
+					"[-l limit1,limit2,...] [-C checkpoint_dir] "
+					"[-i checkpoint_interval] [--resume] "
+					"[-m min_fetches] [-M max_fetches] "
+					"[-T drain_timeout] [-S extract,resolve,graph] "
+					"[-p first_cpu] [-k coroutines] [-K coro_threads] "
+					"[-g graph_size]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+
+	/* One pool thread per fetch the throttle may allow; the ones above
+	   the current limit wait for a slot.  Coroutines need only a few
+	   threads for as many fetches. */
+	if (coroutines > 0)
+	{
+		if (coro_threads < 1)
+			coro_threads = 1;
+		if (coro_threads > MAXT_IN_POOL)
+			coro_threads = MAXT_IN_POOL;
+		if (coroutines < coro_threads)
+			coroutines = coro_threads;
+		max_fetches = coroutines;
+		nworkers = coro_threads;
+		raise_fd_limit(coroutines + 64);
+	}
+	else
+	{
+		if (max_fetches > MAXT_IN_POOL)
+			max_fetches = MAXT_IN_POOL;
+		nworkers = max_fetches;
+	}
+	if (min_fetches < 1)
+		min_fetches = 1;
+	if (max_fetches < min_fetches)
+		max_fetches = min_fetches;
+	if (nworkers > max_fetches)
+		nworkers = max_fetches;
+
+	throttle = throttle_new(min_fetches, max_fetches);
+	
+	if (throttle == NULL)
+	{
+		fprintf(stderr, "Failed to create fetch throttle!\n");
+		return 1;
+	}
+
+	/* Block the crawl signals before any thread starts, so that only
+	   signal_thread takes them. */
+	sigemptyset(&crawl_signals);
+	sigaddset(&crawl_signals, SIGINT);
+	sigaddset(&crawl_signals, SIGTERM);
+	sigaddset(&crawl_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &crawl_signals, NULL);
 
 	/* Create thread pool */
-	pool = create_threadpool(NUM_THREADS);
+	pool = create_threadpool_with_context(nworkers, crawl_context_new,
+										  crawl_context_delete, NULL);
 
-	/* Create url queue */
-	queue = url_queue_new();
+	if (pool == NULL)
+	{
+		fprintf(stderr, "Failed to create thread pool!\n");
+		return 1;
+	}
+
+	/* Cancelling the pool cuts blocked fetches short. */
+	http_set_cancel_fd(get_cancel_fd(pool));
+
+	/* Create url frontier */
+	frontier = frontier_new(FRONTIER_CAPACITY, FRONTIER_SPILL_DIR,
+							BACK_QUEUES_PER_THREAD * max_fetches);
 	
-	if (queue == NULL)
+	if (frontier == NULL)
 	{
-		fprintf(stderr, "Failed to create url queue!\n");
+		fprintf(stderr, "Failed to create url frontier!\n");
 		return 1;
 	}
 
+	frontier_set_politeness(frontier, max_per_host, delay_factor);
+
 	/* Create web graph */
-	graph = webgraph_new(500000);
+	if (graph_size <= 0)
+		graph_size = page_budget > 0 ?
+			page_budget * GRAPH_URLS_PER_PAGE : GRAPH_SIZE;
+	graph = webgraph_new(graph_size, WEBGRAPH_FINGERPRINT_KEYS |
+						 (checkpoint_interval > 0 ? WEBGRAPH_CHECKPOINT : 0));
 	
 	if (graph == NULL)
 	{
@@ -232,24 +1128,191 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	webgraph_add_url(graph, seed_url);	
-	url_enqueue(queue, strdup(seed_url), NULL, depth);
+	if (checkpoint_interval > 0 &&
+		mkdir(checkpoint_dir, 0755) != 0 && errno != EEXIST)
+	{
+		perror("Can't create checkpoint directory");
+		checkpoint_interval = 0;
+	}
+
+	/* A new crawl must not append to the checkpoint of an old one. */
+	if (!resume && checkpoint_interval > 0 &&
+		checkpoint_clear(checkpoint_dir) < 0)
+	{
+		fprintf(stderr, "Failed to clear %s, checkpointing disabled!\n",
+				checkpoint_dir);
+		checkpoint_interval = 0;
+	}
+
+	/* Restore before the link hook is set: the saved page states
+	   already carry the priorities. */
+	if (resume && resume_crawl() < 0)
+		return 1;
+
+	frontier_set_url_source(frontier, webgraph_get_url, graph);
+
+	/* Pages gain priority as their in-links are discovered */
+	webgraph_set_link_hook(graph, frontier_link_hook, frontier);
+
+	added = webgraph_lookup_or_insert(graph, seed_url,
+									  url_fingerprint(seed_url), &seed_id);
+	if (added < 0)
+	{
+		fprintf(stderr, "Failed to add the seed URL!\n");
+		return 1;
+	}
+	if (added)
+	{
+		frontier_push(frontier, seed_id, -1, depth);
+		discovered_at_depth[depth] = 1;
+	}
+
+	/* Parsing gets a thread per core by default, split between its two
+	   stages. */
+	if (extract_threads <= 0)
+		extract_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+			sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (resolve_threads <= 0)
+		resolve_threads = extract_threads > 1 ? extract_threads / 2 : 1;
+	if (graph_threads <= 0)
+		graph_threads = GRAPH_STAGE_THREADS;
+
+	graph_stage = stage_new("graph", STAGE_QUEUE, graph_threads, -1,
+							insert_links, NULL);
+	resolve_stage = stage_new("resolve", STAGE_QUEUE, resolve_threads,
+							  pin_cpu < 0 ? -1 : pin_cpu + extract_threads,
+							  resolve_links, NULL);
+	extract_stage = stage_new("extract", STAGE_QUEUE, extract_threads,
+							  pin_cpu, extract_links, NULL);
 
-	/* Dispatch web crawling job */
-	while(get_num_thread_alive(pool) > 0)
+	if (!graph_stage || !resolve_stage || !extract_stage)
 	{
-		dispatch(pool, retrieve_webpage, NULL);	
-		usleep(10000);
+		fprintf(stderr, "Failed to start the page pipeline!\n");
+		return 1;
+	}
+
+	/* Coroutine schedulers sleep until the frontier or a finished
+	   fetch wakes them, and leave host lookups to the dns stage. */
+	if (coroutines > 0)
+	{
+		scheds = (struct coro_sched **)calloc(coro_threads,
+											  sizeof(*scheds));
+		dns_stage = stage_new("dns", STAGE_QUEUE, DNS_STAGE_THREADS, -1,
+							  lookup_host, NULL);
+		if (!scheds || !dns_stage)
+		{
+			fprintf(stderr, "Failed to start the coroutine schedulers!\n");
+			return 1;
+		}
+		frontier_set_wake_hook(frontier, wake_schedulers, NULL);
 	}
 
+	/* Start the crawl loops, then wait for them, waking up only to
+	   take checkpoints. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	workers_running = nworkers;
+	for (i = 0; i < nworkers; i++)
+		dispatch(pool, coroutines > 0 ? coro_crawl_worker : crawl_worker,
+				 NULL);
+
+	pthread_create(&signal_tid, NULL, signal_thread, NULL);
+
+	last_checkpoint = now_seconds();
+	pthread_mutex_lock(&done_lock);
+	while (workers_running > 0 && !stop_requested)
+	{
+		if (checkpoint_interval > 0)
+		{
+			double due = last_checkpoint + checkpoint_interval;
+			struct timespec ts;
+
+			ts.tv_sec = (time_t)due;
+			ts.tv_nsec = (long)((due - ts.tv_sec) * 1e9);
+			pthread_cond_timedwait(&done_cond, &done_lock, &ts);
+
+			if (workers_running > 0 && !stop_requested &&
+				now_seconds() >= due)
+			{
+				pthread_mutex_unlock(&done_lock);
+				take_checkpoint();
+				last_checkpoint = now_seconds();
+				pthread_mutex_lock(&done_lock);
+			}
+		}
+		else
+			pthread_cond_wait(&done_cond, &done_lock);
+	}
+
+	/* Stopped early: hand out no more pages, give the fetches in
+	   progress drain_timeout to finish, then cancel the rest. */
+	if (workers_running > 0)
+	{
+		pthread_mutex_unlock(&done_lock);
+		frontier_stop(frontier);
+		if (drain_threadpool(pool, drain_timeout) < 0)
+			printf("Cancelled the fetches still running after %.1fs.\n",
+				   drain_timeout);
+		pthread_mutex_lock(&done_lock);
+
+		while (workers_running > 0)
+			pthread_cond_wait(&done_cond, &done_lock);
+	}
+	pthread_mutex_unlock(&done_lock);
+
+	/* Finish the pages still in the pipeline, upstream first. */
+	stage_close(extract_stage);
+	stage_close(resolve_stage);
+	stage_close(graph_stage);
+	if (dns_stage)
+		stage_close(dns_stage);
+
+	if (checkpoint_interval > 0)
+		take_checkpoint();
+
+	pthread_cancel(signal_tid);
+	pthread_join(signal_tid, NULL);
+
 	destroy_threadpool(pool); 
+
+	if (frontier_finished(frontier))
+		printf("Crawl complete: no pages left.\n");
+	else
+		printf("Crawl stopped with %d pages queued.\n",
+			   frontier_count(frontier));
+
+	printf("Fetched %ld pages, %ld bytes; %ld failed fetches.\n",
+		   total_pages, total_bytes, total_errors);
 	
 	pagerank(graph, 0.85, 0.0000001);  
 	print_top_n(graph, 10);
 
+	printf("Seen-set filter false-positive rate: %lf\n",
+			webgraph_filter_fp_rate(graph));
+
+	print_depth_stats();
+
+	print_stage_stats();
+
 	/* Clean up */
+	if (dns_stage)
+	{
+		frontier_set_wake_hook(frontier, NULL, NULL);
+		for (i = 0; i < nscheds; i++)
+			if (scheds[i])
+				coro_sched_delete(scheds[i]);
+		free(scheds);
+		stage_delete(dns_stage);
+	}
 	webgraph_delete(graph);
-	url_queue_delete(queue);
+	frontier_delete(frontier);
+	throttle_delete(throttle);
+	stage_delete(extract_stage);
+	stage_delete(resolve_stage);
+	stage_delete(graph_stage);
 
 	return 0;
 }
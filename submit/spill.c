@@ -0,0 +1,657 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "spill.h"
+
+/* Number of entries per block, and per segment file. */
+#define SPILL_BLOCK_ENTRIES 4096
+
+#define SPILL_MAGIC "USG2"
+
+#define BLOCK_MEMORY 0
+#define BLOCK_DISK   1
+
+struct spill_block
+{
+	unsigned long seq;
+	int state;
+	int busy;		/* owned by the spill thread while set */
+	int count;
+	int pos;
+	struct url_entry *entries;
+	struct spill_block *next;
+};
+
+struct url_spill
+{
+	char *dir;
+	int disabled;	/* stop writing after an I/O error */
+
+	struct spill_block *head;
+	struct spill_block *tail;
+	unsigned long next_seq;
+
+	long count;
+	long on_disk;
+
+	pthread_mutex_t lock;
+
+	/* NULL when nothing goes to disk */
+	struct spill_service *service;
+	struct url_spill *service_next;
+};
+
+/* One thread does the disk I/O of all the stores registered with it,
+   a block at a time from each in turn. */
+struct spill_service
+{
+	spill_ready_fn ready;
+	void *ready_arg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	int pending;	/* some store may have work */
+	struct url_spill *spills;
+	struct url_spill *current;	/* being worked on, unlocked */
+	pthread_t thread;
+	int shutdown;
+};
+
+static void segment_path(struct url_spill *spill, unsigned long seq,
+						 char *buf, int size)
+{
+	snprintf(buf, size, "%s/segment-%010lu", spill->dir, seq);
+}
+
+static struct spill_block *block_new(struct url_spill *spill)
+{
+	struct spill_block *b;
+
+	b = (struct spill_block *)calloc(1, sizeof(struct spill_block));
+	b->entries = (struct url_entry *)
+		malloc(SPILL_BLOCK_ENTRIES * sizeof(struct url_entry));
+	b->seq = spill->next_seq++;
+	b->state = BLOCK_MEMORY;
+	return b;
+}
+
+static void block_free(struct url_spill *spill, struct spill_block *b)
+{
+	if (b->state == BLOCK_DISK)
+	{
+		char path[4096];
+		segment_path(spill, b->seq, path, sizeof(path));
+		unlink(path);
+	}
+
+	free(b->entries);
+	free(b);
+}
+
+static void put_varint(unsigned char **p, unsigned long v)
+{
+	while (v >= 0x80)
+	{
+		*(*p)++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*(*p)++ = (unsigned char)v;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end,
+					  unsigned long *v)
+{
+	unsigned long r = 0;
+	int shift = 0;
+
+	while (*p < end && shift < 64)
+	{
+		unsigned char c = *(*p)++;
+		r |= (unsigned long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			*v = r;
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+#define ZIGZAG(v)   (((unsigned long)(v) << 1) ^ \
+					 (unsigned long)((v) >> (sizeof(long) * CHAR_BIT - 1)))
+#define UNZIGZAG(u) ((long)((u) >> 1) ^ -(long)((u) & 1))
+
+/* Delta-code the block: ids are stored as the difference from the
+   previous entry's, which is small since pages found together get
+   neighbouring ids, and the referer relative to the page itself. */
+static int write_block(struct url_spill *spill, struct spill_block *b)
+{
+	char path[4096];
+	unsigned char *buf, *p;
+	long prev = 0;
+	int i;
+	FILE *fp;
+	int ok;
+
+	/* four varints of at most 10 bytes per entry */
+	p = buf = (unsigned char *)malloc(16 + (b->count - b->pos) * 40);
+	if (buf == NULL)
+		return 0;
+
+	memcpy(p, SPILL_MAGIC, 4);
+	p += 4;
+	put_varint(&p, b->count - b->pos);
+
+	for (i = b->pos; i < b->count; i++)
+	{
+		const struct url_entry *e = &b->entries[i];
+
+		put_varint(&p, ZIGZAG(e->id - prev));
+		put_varint(&p, ZIGZAG(e->referer - e->id));
+		put_varint(&p, (unsigned int)e->depth);
+		put_varint(&p, (unsigned int)e->priority);
+
+		prev = e->id;
+	}
+
+	segment_path(spill, b->seq, path, sizeof(path));
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+	{
+		free(buf);
+		return 0;
+	}
+
+	ok = fwrite(buf, 1, p - buf, fp) == (size_t)(p - buf);
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (!ok)
+		unlink(path);
+
+	free(buf);
+	return ok;
+}
+
+static int read_block(struct url_spill *spill, struct spill_block *b,
+					  struct url_entry **entries_out, int *count_out)
+{
+	char path[4096];
+	unsigned char *buf = NULL;
+	const unsigned char *p, *end;
+	struct url_entry *entries = NULL;
+	unsigned long n, i;
+	long prev = 0;
+	long size;
+	FILE *fp;
+
+	segment_path(spill, b->seq, path, sizeof(path));
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return 0;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 4)
+		goto error;
+	rewind(fp);
+
+	buf = (unsigned char *)malloc(size);
+	if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size)
+		goto error;
+
+	p = buf;
+	end = buf + size;
+	if (memcmp(p, SPILL_MAGIC, 4) != 0)
+		goto error;
+	p += 4;
+
+	if (!get_varint(&p, end, &n) || n > SPILL_BLOCK_ENTRIES)
+		goto error;
+
+	entries = (struct url_entry *)
+		malloc(SPILL_BLOCK_ENTRIES * sizeof(struct url_entry));
+
+	for (i = 0; i < n; i++)
+	{
+		unsigned long id, referer, depth, priority;
+
+		if (!get_varint(&p, end, &id) || !get_varint(&p, end, &referer) ||
+			!get_varint(&p, end, &depth) || !get_varint(&p, end, &priority))
+			goto error;
+
+		prev += UNZIGZAG(id);
+		entries[i].id = prev;
+		entries[i].referer = prev + UNZIGZAG(referer);
+		entries[i].depth = (int)depth;
+		entries[i].priority = (int)priority;
+	}
+
+	fclose(fp);
+	free(buf);
+	unlink(path);
+
+	*entries_out = entries;
+	*count_out = (int)n;
+	return 1;
+
+error:
+	free(entries);
+	free(buf);
+	fclose(fp);
+	return 0;
+}
+
+/* The head and the block after it are the next to be consumed. */
+static struct spill_block *pick_prefetch(struct url_spill *spill)
+{
+	struct spill_block *b;
+	int i;
+
+	for (i = 0, b = spill->head; b && i < 2; i++, b = b->next)
+		if (b->state == BLOCK_DISK && !b->busy)
+			return b;
+	return NULL;
+}
+
+/* The newest full block that is not about to be consumed. */
+static struct spill_block *pick_victim(struct url_spill *spill)
+{
+	struct spill_block *b, *victim = NULL;
+
+	if (spill->disabled || !spill->head || !spill->head->next)
+		return NULL;
+
+	for (b = spill->head->next->next; b && b != spill->tail; b = b->next)
+		if (b->state == BLOCK_MEMORY && !b->busy)
+			victim = b;
+	return victim;
+}
+
+/* Tell the service thread that SPILL may have work. */
+static void kick(struct url_spill *spill)
+{
+	struct spill_service *svc = spill->service;
+
+	if (svc == NULL)
+		return;
+
+	pthread_mutex_lock(&svc->lock);
+	svc->pending = 1;
+	pthread_cond_signal(&svc->work);
+	pthread_mutex_unlock(&svc->lock);
+}
+
+/* Read back or write out one block of SPILL.  Returns 0 if there was
+   nothing to do, 1 after a write and 2 after a read. */
+static int spill_step(struct url_spill *spill)
+{
+	struct spill_block *b;
+	int ret = 0;
+
+	pthread_mutex_lock(&spill->lock);
+
+	if ((b = pick_prefetch(spill)) != NULL)
+	{
+		struct url_entry *entries = NULL;
+		int count = 0;
+		int ok;
+
+		b->busy = 1;
+		pthread_mutex_unlock(&spill->lock);
+		ok = read_block(spill, b, &entries, &count);
+		pthread_mutex_lock(&spill->lock);
+
+		if (!ok)
+		{
+			fprintf(stderr, "Failed to read frontier segment %lu, "
+					"%d entries lost!\n", b->seq, b->count - b->pos);
+			__atomic_sub_fetch(&spill->count, b->count - b->pos,
+							   __ATOMIC_RELAXED);
+			entries = (struct url_entry *)
+				malloc(SPILL_BLOCK_ENTRIES * sizeof(struct url_entry));
+			count = 0;
+		}
+
+		b->entries = entries;
+		b->count = count;
+		b->pos = 0;
+		b->state = BLOCK_MEMORY;
+		b->busy = 0;
+		--spill->on_disk;
+		ret = 2;
+	}
+	else if ((b = pick_victim(spill)) != NULL)
+	{
+		int ok;
+
+		b->busy = 1;
+		pthread_mutex_unlock(&spill->lock);
+		ok = write_block(spill, b);
+		pthread_mutex_lock(&spill->lock);
+
+		if (ok)
+		{
+			free(b->entries);
+			b->entries = NULL;
+			b->state = BLOCK_DISK;
+			++spill->on_disk;
+		}
+		else
+		{
+			perror("Failed to write frontier segment, "
+				   "keeping the frontier in memory");
+			spill->disabled = 1;
+		}
+		b->busy = 0;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&spill->lock);
+
+	return ret;
+}
+
+static void *service_thread(void *arg)
+{
+	struct spill_service *svc = (struct spill_service *)arg;
+	struct url_spill *spill, *next;
+	int step, loaded;
+
+	pthread_mutex_lock(&svc->lock);
+
+	while (!svc->shutdown)
+	{
+		if (!svc->pending)
+		{
+			pthread_cond_wait(&svc->work, &svc->lock);
+			continue;
+		}
+		svc->pending = 0;
+		loaded = 0;
+
+		for (spill = svc->spills; spill && !svc->shutdown; spill = next)
+		{
+			svc->current = spill;
+			pthread_mutex_unlock(&svc->lock);
+			step = spill_step(spill);
+			pthread_mutex_lock(&svc->lock);
+
+			/* Come back for the rest of its work after the others. */
+			if (step)
+				svc->pending = 1;
+			if (step == 2)
+				loaded = 1;
+
+			next = spill->service_next;
+			svc->current = NULL;
+			pthread_cond_broadcast(&svc->idle);
+		}
+
+		if (loaded && svc->ready)
+		{
+			pthread_mutex_unlock(&svc->lock);
+			svc->ready(svc->ready_arg);
+			pthread_mutex_lock(&svc->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&svc->lock);
+	return NULL;
+}
+
+/* Start the thread that does the disk I/O of the stores created with
+   it.  FN is called, with no store locked, whenever entries have been
+   read back and spill_pop may return what it could not before. */
+struct spill_service *spill_service_new(spill_ready_fn fn, void *arg)
+{
+	struct spill_service *svc;
+
+	svc = (struct spill_service *)calloc(1, sizeof(struct spill_service));
+	if (svc == NULL)
+		return NULL;
+
+	svc->ready = fn;
+	svc->ready_arg = arg;
+	pthread_mutex_init(&svc->lock, NULL);
+	pthread_cond_init(&svc->work, NULL);
+	pthread_cond_init(&svc->idle, NULL);
+
+	if (pthread_create(&svc->thread, NULL, service_thread, svc) != 0)
+	{
+		fprintf(stderr, "Failed to start frontier spill thread!\n");
+		pthread_cond_destroy(&svc->idle);
+		pthread_cond_destroy(&svc->work);
+		pthread_mutex_destroy(&svc->lock);
+		free(svc);
+		return NULL;
+	}
+
+	return svc;
+}
+
+/* Stop the thread.  The stores of SVC must be deleted first. */
+void spill_service_delete(struct spill_service *svc)
+{
+	pthread_mutex_lock(&svc->lock);
+	svc->shutdown = 1;
+	pthread_cond_signal(&svc->work);
+	pthread_mutex_unlock(&svc->lock);
+
+	pthread_join(svc->thread, NULL);
+
+	pthread_cond_destroy(&svc->idle);
+	pthread_cond_destroy(&svc->work);
+	pthread_mutex_destroy(&svc->lock);
+	free(svc);
+}
+
+/* A store in DIR whose disk I/O is done by SVC; with a NULL DIR or
+   SVC everything stays in memory. */
+struct url_spill *spill_new(const char *dir, struct spill_service *svc)
+{
+	struct url_spill *spill;
+
+	spill = (struct url_spill *)calloc(1, sizeof(struct url_spill));
+	if (spill == NULL)
+		return NULL;
+
+	pthread_mutex_init(&spill->lock, NULL);
+
+	if (dir == NULL || svc == NULL)
+		return spill;
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+	{
+		perror("Can't create frontier spill directory");
+		return spill;
+	}
+
+	spill->dir = strdup(dir);
+	spill->service = svc;
+
+	pthread_mutex_lock(&svc->lock);
+	spill->service_next = svc->spills;
+	svc->spills = spill;
+	pthread_mutex_unlock(&svc->lock);
+
+	return spill;
+}
+
+void spill_delete(struct url_spill *spill)
+{
+	struct spill_block *b;
+
+	if (spill->service)
+	{
+		struct spill_service *svc = spill->service;
+		struct url_spill **p;
+
+		pthread_mutex_lock(&svc->lock);
+		for (p = &svc->spills; *p != spill; p = &(*p)->service_next)
+			;
+		*p = spill->service_next;
+		while (svc->current == spill)
+			pthread_cond_wait(&svc->idle, &svc->lock);
+		pthread_mutex_unlock(&svc->lock);
+	}
+
+	while ((b = spill->head) != NULL)
+	{
+		spill->head = b->next;
+		block_free(spill, b);
+	}
+
+	if (spill->dir)
+	{
+		rmdir(spill->dir);
+		free(spill->dir);
+	}
+
+	pthread_mutex_destroy(&spill->lock);
+	free(spill);
+}
+
+void spill_push(struct url_spill *spill, const struct url_entry *e)
+{
+	struct spill_block *tail;
+
+	pthread_mutex_lock(&spill->lock);
+
+	tail = spill->tail;
+	if (tail == NULL || tail->count == SPILL_BLOCK_ENTRIES)
+	{
+		tail = block_new(spill);
+		if (spill->tail)
+			spill->tail->next = tail;
+		else
+			spill->head = tail;
+		spill->tail = tail;
+
+		kick(spill);
+	}
+
+	tail->entries[tail->count++] = *e;
+
+	__atomic_add_fetch(&spill->count, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&spill->lock);
+}
+
+static void retire_head(struct url_spill *spill)
+{
+	struct spill_block *b = spill->head;
+
+	if (b == spill->tail)
+	{
+		b->pos = b->count = 0;
+		return;
+	}
+
+	spill->head = b->next;
+	block_free(spill, b);
+
+	/* The next block may still need to be read back. */
+	kick(spill);
+}
+
+/* Return the head block if an entry can be taken from it right now. */
+static struct spill_block *head_ready(struct url_spill *spill)
+{
+	struct spill_block *b;
+
+	while ((b = spill->head) != NULL)
+	{
+		if (b->busy || b->state == BLOCK_DISK)
+			return NULL;
+		if (b->pos < b->count)
+			return b;
+		if (b == spill->tail)
+			return NULL;
+		retire_head(spill);
+	}
+	return NULL;
+}
+
+static void take(struct url_spill *spill, struct spill_block *b)
+{
+	if (++b->pos == b->count)
+		retire_head(spill);
+	__atomic_sub_fetch(&spill->count, 1, __ATOMIC_RELEASE);
+}
+
+/* Remove the oldest entry.  Returns 0 if the store is empty, or if
+   the oldest entries are still on disk: those are read back in the
+   background, and the service's ready function is called once they
+   are in. */
+int spill_pop(struct url_spill *spill, struct url_entry *e)
+{
+	struct spill_block *b;
+
+	pthread_mutex_lock(&spill->lock);
+
+	if ((b = head_ready(spill)) == NULL)
+	{
+		if (__atomic_load_n(&spill->count, __ATOMIC_RELAXED) != 0)
+			kick(spill);
+		pthread_mutex_unlock(&spill->lock);
+		return 0;
+	}
+
+	*e = b->entries[b->pos];
+	take(spill, b);
+
+	pthread_mutex_unlock(&spill->lock);
+
+	return 1;
+}
+
+/* Offer up to MAX of the oldest entries to FN, in order, removing the
+   ones it accepts.  Stops at the first refusal.  Never blocks: returns
+   0 at once if another thread is using the store or the next entries
+   are not in memory yet. */
+int spill_drain(struct url_spill *spill,
+				spill_drain_fn fn,
+				void *arg,
+				int max)
+{
+	struct spill_block *b;
+	int moved = 0;
+
+	if (pthread_mutex_trylock(&spill->lock) != 0)
+		return 0;
+
+	while (moved < max && (b = head_ready(spill)) != NULL)
+	{
+		if (!fn(arg, &b->entries[b->pos]))
+			break;
+		take(spill, b);
+		moved++;
+	}
+
+	pthread_mutex_unlock(&spill->lock);
+
+	return moved;
+}
+
+long spill_count(struct url_spill *spill)
+{
+	return __atomic_load_n(&spill->count, __ATOMIC_ACQUIRE);
+}
+
+long spill_segments_on_disk(struct url_spill *spill)
+{
+	long n;
+
+	pthread_mutex_lock(&spill->lock);
+	n = spill->on_disk;
+	pthread_mutex_unlock(&spill->lock);
+
+	return n;
+}
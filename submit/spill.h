@@ -0,0 +1,59 @@
+#ifndef _SPILL_H
+#define _SPILL_H
+
+/*
+ * Overflow store of the URL frontier.  Entries are kept FIFO in
+ * fixed-size blocks; the block being drained and the block being
+ * filled stay in memory, the blocks in between are written to
+ * append-only, delta-coded segment files and read back before
+ * consumers reach them.  Consumers never wait for the disk: the reads
+ * and writes of all the stores sharing a spill_service are done by
+ * its one background thread.
+ *
+ * With a NULL directory nothing is written to disk and the blocks
+ * simply stay in memory.
+ */
+
+/* One frontier record.  The URL itself lives in the web graph and is
+   looked up by id only when the page is fetched. */
+struct url_entry
+{
+	long id;		/* node id of the page */
+	long referer;	/* node id of the page linking to it, or -1 */
+	int depth;
+	int priority;
+};
+
+struct url_spill;
+
+struct spill_service;
+
+/* Accept or refuse one entry offered by spill_drain. */
+typedef int (*spill_drain_fn)(void *arg, const struct url_entry *e);
+
+/* Called when entries spill_pop could not return have been read. */
+typedef void (*spill_ready_fn)(void *arg);
+
+extern struct spill_service *spill_service_new(spill_ready_fn fn, void *arg);
+
+extern void spill_service_delete(struct spill_service *svc);
+
+extern struct url_spill *spill_new(const char *dir,
+								   struct spill_service *svc);
+
+extern void spill_delete(struct url_spill *spill);
+
+extern void spill_push(struct url_spill *spill, const struct url_entry *e);
+
+extern int spill_pop(struct url_spill *spill, struct url_entry *e);
+
+extern int spill_drain(struct url_spill *spill,
+					   spill_drain_fn fn,
+					   void *arg,
+					   int max);
+
+extern long spill_count(struct url_spill *spill);
+
+extern long spill_segments_on_disk(struct url_spill *spill);
+
+#endif
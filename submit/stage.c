@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "stage.h"
+#include "coro.h"
+
+/* A coroutine waiting in stage_put for room; see put_wait. */
+struct stage_waiter
+{
+	struct coro *coro;
+	int woken;
+	struct stage_waiter *next;
+};
+
+struct stage
+{
+	char *name;
+	stage_fn fn;
+	void *arg;
+
+	/* ring of items, under lock */
+	void **items;
+	int capacity;
+	int head;
+	int count;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct stage_waiter *coro_waiters;
+
+	pthread_t *threads;
+	int nthreads;	/* not yet joined */
+	int started;
+
+	/* statistics, under lock */
+	long processed;
+	long occupancy_sum;	/* queue length seen by each arriving item */
+	int occupancy_max;
+	long full_waits;
+	long empty_waits;
+};
+
+struct stage_thread_arg
+{
+	struct stage *s;
+	int cpu;
+};
+
+static void *stage_thread(void *p)
+{
+	struct stage_thread_arg *targ = (struct stage_thread_arg *)p;
+	struct stage *s = targ->s;
+	void *item;
+
+	if (targ->cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(targ->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			fprintf(stderr, "Can't pin stage %s to core %d!\n",
+					s->name, targ->cpu);
+	}
+	free(targ);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&s->lock);
+		if (s->count == 0 && !s->closed)
+		{
+			s->empty_waits++;
+			while (s->count == 0 && !s->closed)
+				pthread_cond_wait(&s->not_empty, &s->lock);
+		}
+		if (s->count == 0)
+		{
+			/* closed and drained */
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+
+		item = s->items[s->head];
+		s->head = (s->head + 1) % s->capacity;
+		s->count--;
+		s->processed++;
+		pthread_cond_signal(&s->not_full);
+		if (s->coro_waiters)
+		{
+			struct stage_waiter *w = s->coro_waiters;
+
+			s->coro_waiters = w->next;
+			w->woken = 1;
+			coro_wake(w->coro);
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		s->fn(item, s->arg);
+	}
+
+	return NULL;
+}
+
+struct stage *stage_new(const char *name,
+						int capacity,
+						int threads,
+						int pin_cpu,
+						stage_fn fn,
+						void *arg)
+{
+	struct stage *s;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (capacity < 1 || threads < 1)
+		return NULL;
+
+	s = (struct stage *)calloc(1, sizeof(struct stage));
+	if (s == NULL)
+		return NULL;
+
+	s->name = strdup(name);
+	s->fn = fn;
+	s->arg = arg;
+	s->capacity = capacity;
+	s->items = (void **)malloc(capacity * sizeof(void *));
+	s->threads = (pthread_t *)malloc(threads * sizeof(pthread_t));
+
+	if (s->name == NULL || s->items == NULL || s->threads == NULL)
+	{
+		free(s->name);
+		free(s->items);
+		free(s->threads);
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->not_empty, NULL);
+	pthread_cond_init(&s->not_full, NULL);
+
+	if (ncpu < 1)
+		ncpu = 1;
+
+	for (i = 0; i < threads; i++)
+	{
+		struct stage_thread_arg *targ =
+			(struct stage_thread_arg *)malloc(sizeof(*targ));
+
+		targ->s = s;
+		targ->cpu = pin_cpu >= 0 ? (int)((pin_cpu + i) % ncpu) : -1;
+		if (pthread_create(&s->threads[i], NULL, stage_thread, targ) != 0)
+		{
+			fprintf(stderr, "Failed to start stage %s!\n", name);
+			free(targ);
+			break;
+		}
+		s->nthreads++;
+	}
+
+	if (s->nthreads == 0)
+	{
+		stage_delete(s);
+		return NULL;
+	}
+	s->started = s->nthreads;
+
+	return s;
+}
+
+/* Wait in a coroutine for room in S, parked so that the thread runs
+   the other coroutines meanwhile.  Called and returns with S's lock
+   held; returns -1 if the coroutine is cancelled. */
+static int put_wait(struct stage *s)
+{
+	struct stage_waiter w, **p;
+	int ret;
+
+	w.coro = coro_self();
+	w.woken = 0;
+	w.next = s->coro_waiters;
+	s->coro_waiters = &w;
+
+	pthread_mutex_unlock(&s->lock);
+	ret = coro_park(-1.0);
+	pthread_mutex_lock(&s->lock);
+
+	if (!w.woken)
+	{
+		for (p = &s->coro_waiters; *p != &w; p = &(*p)->next)
+			;
+		*p = w.next;
+	}
+	return ret;
+}
+
+/* Queue ITEM, waiting while the queue is full.  In a coroutine only
+   the coroutine waits. */
+void stage_put(struct stage *s, void *item)
+{
+	int in_coro = coro_running();
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->count == s->capacity)
+	{
+		s->full_waits++;
+		while (s->count == s->capacity)
+		{
+			/* Once cancelled a coroutine can no longer park; the
+			   stage still drains, so block the thread for the rest. */
+			if (in_coro && put_wait(s) == 0)
+				continue;
+			in_coro = 0;
+			pthread_cond_wait(&s->not_full, &s->lock);
+		}
+	}
+
+	s->occupancy_sum += s->count;
+	s->items[(s->head + s->count) % s->capacity] = item;
+	if (++s->count > s->occupancy_max)
+		s->occupancy_max = s->count;
+
+	pthread_cond_signal(&s->not_empty);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Take no more items and wait for the queued ones to be processed. */
+void stage_close(struct stage *s)
+{
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	s->closed = 1;
+	pthread_cond_broadcast(&s->not_empty);
+	pthread_mutex_unlock(&s->lock);
+
+	for (i = 0; i < s->nthreads; i++)
+		pthread_join(s->threads[i], NULL);
+	s->nthreads = 0;
+}
+
+void stage_delete(struct stage *s)
+{
+	if (s->nthreads)
+		stage_close(s);
+
+	pthread_cond_destroy(&s->not_full);
+	pthread_cond_destroy(&s->not_empty);
+	pthread_mutex_destroy(&s->lock);
+
+	free(s->threads);
+	free(s->items);
+	free(s->name);
+	free(s);
+}
+
+void stage_print_stats_header(void)
+{
+	printf("stage     threads      items  capacity  avg queue  max queue  "
+		   "full waits  idle waits\n");
+}
+
+void stage_print_stats(struct stage *s)
+{
+	pthread_mutex_lock(&s->lock);
+	printf("%-8s  %7d  %9ld  %8d  %9.1f  %9d  %10ld  %10ld\n",
+		   s->name, s->started, s->processed, s->capacity,
+		   s->processed ? (double)s->occupancy_sum / s->processed : 0.0,
+		   s->occupancy_max, s->full_waits, s->empty_waits);
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef _STAGE_H
+#define _STAGE_H
+
+/*
+ * Pipeline stages.
+ *
+ * A stage is a bounded queue of items and a set of threads of its own
+ * that take items off it and call the stage function on each.  The
+ * function usually hands the item on with stage_put to the next stage;
+ * when that stage's queue is full stage_put blocks, so a slow stage
+ * holds back the ones feeding it instead of letting work pile up.  A
+ * coroutine calling stage_put is parked instead of blocking its
+ * thread.
+ *
+ * Threads of CPU-bound stages can be pinned: with PIN_CPU >= 0 thread
+ * i runs on core (PIN_CPU + i) modulo the number of online cores.
+ *
+ * Each stage counts the items it processed, how full its queue was
+ * when items arrived, and how often producers had to wait for room
+ * (backpressure) or its threads for work (starvation).
+ */
+
+struct stage;
+
+typedef void (*stage_fn)(void *item, void *arg);
+
+extern struct stage *stage_new(const char *name,
+							   int capacity,
+							   int threads,
+							   int pin_cpu,
+							   stage_fn fn,
+							   void *arg);
+
+extern void stage_put(struct stage *s, void *item);
+
+extern void stage_close(struct stage *s);
+
+extern void stage_delete(struct stage *s);
+
+extern void stage_print_stats_header(void);
+
+extern void stage_print_stats(struct stage *s);
+
+#endif
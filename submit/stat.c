@@ -1,17 +1,10 @@
 #include "stat.h"
-#include <pthread.h>
 
 static long cur_urlid = 0;
 
-static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
-
-long *get_cur_urlid()
+/* Hand out the next URL id.  Ids are plain values now: callers store
+   them in the tables inline instead of through a malloc'd pointer. */
+long get_cur_urlid(void)
 {
-	long *ret = NULL;
-	ret = (long *)malloc(sizeof(long));
-	pthread_mutex_lock(&id_lock);
-	*ret = cur_urlid;
-	++cur_urlid;
-	pthread_mutex_unlock(&id_lock);
-	return ret;
+	return __atomic_fetch_add(&cur_urlid, 1, __ATOMIC_RELAXED);
 }
@@ -1,6 +1,6 @@
 #ifndef _STAT_H
 #define _STAT_H
 
-extern long *get_cur_urlid();
+extern long get_cur_urlid(void);
 
 #endif
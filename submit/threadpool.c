@@ -1,7 +1,27 @@
 /**
  * threadpool.c
  *
- * This file will contain your implementation of a threadpool.
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a deque (Chase-Lev): it pushes and pops tasks at
+ * the bottom without locking, while idle workers steal from the top
+ * of a randomly chosen victim.  Tasks dispatched from outside the pool
+ * go to the lock-free inbox of a random worker, from which the owner
+ * or a thief takes them all at once.  Task structs come from slabs and
+ * are recycled through per-worker free lists.  Workers with nothing to
+ * do sleep on a condition variable that dispatch only touches when
+ * someone is asleep.
+ *
+ * Each thread knows its own worker through a thread-local pointer,
+ * which gives it its index and the context the pool's init function
+ * built for it without searching.
+ *
+ * Stopping comes in three strengths.  Pausing holds tasks back until
+ * resume.  Draining refuses new tasks and waits, up to a deadline, for
+ * the queued and running ones to finish.  Cancelling discards what is
+ * queued and asks running tasks to give up: they learn about it from
+ * worker_cancelled, or by polling the pool's cancel descriptor, which
+ * becomes readable, so that blocking I/O can be cut short too.
  */
 
 #include "threadpool.h"
@@ -9,113 +29,438 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
-/*
- * _threadpool is the internal threadpool structure that is
- * cast to type "threadpool" before it given out to callers
- */
+#include <time.h>
+#include <unistd.h>
+
+/* Tasks per deque; beyond that the owner spills into its inbox. */
+#define DEQUE_SIZE 1024
+
+/* Task structs allocated at a time. */
+#define TASK_SLAB 64
+
+/* Free tasks a worker keeps before returning a slab's worth. */
+#define LOCAL_FREE_MAX (4 * TASK_SLAB)
+
+/* Rounds over all victims before an idle worker goes to sleep. */
+#define STEAL_ROUNDS 2
+
+#define CACHELINE 64
 
 typedef struct work_st {
     void (*routine) (void *);
     void *arg;
-    struct work_st *next;
+    struct work_st *next;	/* inbox or free list link */
 } work_t;
 
+typedef struct worker_st {
+	/* stolen from by everybody */
+	long top;
+	char pad0[CACHELINE];
+	/* owner only */
+	long bottom;
+	char pad1[CACHELINE];
+	work_t *inbox;		/* Treiber stack, taken whole */
+	char pad2[CACHELINE];
+
+	work_t *slots[DEQUE_SIZE];
+
+	work_t *free_list;	/* owner only */
+	int num_free;
+	unsigned int seed;
+	int index;
+	void *context;		/* from the pool's init function */
+	struct _threadpool_st *pool;
+} worker_t;
+
+typedef struct slab_st {
+	work_t tasks[TASK_SLAB];
+	struct slab_st *next;
+} slab_t;
+
 typedef struct _threadpool_st {
-    /* you should fill in this structure with whatever you need */
-    int num_threads;	/* number of active threads */
+    int num_threads;	/* number of threads */
 	int num_threads_alive;
-    int qsize;			/* number in the queue */
     pthread_t *threads;	/* pointer to threads */
-    work_t *qhead;		/* queue head pointer */
-    work_t *qtail;		/* queue tail pointer */
-    pthread_mutex_t qlock;		/* lock on the queue list */
-    pthread_cond_t q_not_empty;	/* non empty and empty condidtion vairiables */
-    pthread_cond_t q_empty;
+	worker_t **workers;
+
+	long pending;		/* tasks dispatched but not started */
+	long running;
+	int sleepers;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+
+	/* set under idle_lock; pause_cond wakes worker_continue and
+	   drain_cond the drainer */
+	int paused;
+	int draining;
+	int cancelled;
+	pthread_cond_t pause_cond;
+	pthread_cond_t drain_cond;
+	int cancel_pipe[2];
+
+	/* shared free tasks and every slab, for callers outside the pool */
+	pthread_mutex_t alloc_lock;
+	work_t *free_list;
+	slab_t *slabs;
+
+	unsigned int dispatch_seed;
     int shutdown;
-    int dont_accept;
+
+	worker_init_fn init;
+	worker_fini_fn fini;
+	void *init_arg;
 } _threadpool;
 
+struct worker_arg {
+	_threadpool *pool;
+	worker_t *self;
+};
+
+/* The worker the calling thread is, if any. */
+static __thread worker_t *current_worker;
+
+static unsigned int next_random(unsigned int *seed)
+{
+	unsigned int x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *seed = x ? x : 1;
+}
+
+/* Deque: only the owner calls push and pop. */
+
+static int deque_push(worker_t *w, work_t *t)
+{
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+
+	if (b - top >= DEQUE_SIZE)
+		return 0;
+
+	__atomic_store_n(&w->slots[b & (DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static work_t *deque_pop(worker_t *w)
+{
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	long top;
+	work_t *t;
+
+	__atomic_store_n(&w->bottom, b, __ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+
+	if (top > b)
+	{
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	t = __atomic_load_n(&w->slots[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (top == b)
+	{
+		/* Last one: race the thieves for it. */
+		if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0,
+										 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			t = NULL;
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return t;
+}
+
+static work_t *deque_steal(worker_t *w)
+{
+	long top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+	work_t *t;
+
+	if (top >= b)
+		return NULL;
+
+	t = __atomic_load_n(&w->slots[top & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0,
+									 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return t;
+}
+
+static void inbox_push(worker_t *w, work_t *t)
+{
+	work_t *head = __atomic_load_n(&w->inbox, __ATOMIC_RELAXED);
+
+	do
+		t->next = head;
+	while (!__atomic_compare_exchange_n(&w->inbox, &head, t, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Take every task in W's inbox, oldest first.  Taking the whole stack
+   at once leaves no room for ABA. */
+static work_t *inbox_take(worker_t *w)
+{
+	work_t *t, *fifo = NULL;
+
+	if (__atomic_load_n(&w->inbox, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	t = __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE);
+	while (t)
+	{
+		work_t *next = t->next;
+		t->next = fifo;
+		fifo = t;
+		t = next;
+	}
+	return fifo;
+}
+
+/* Run the first of LIST and keep the rest on SELF. */
+static work_t *adopt(worker_t *self, work_t *list)
+{
+	work_t *first = list, *t;
+
+	if (list == NULL)
+		return NULL;
+
+	for (t = list->next; t; )
+	{
+		work_t *next = t->next;
+		if (!deque_push(self, t))
+			inbox_push(self, t);
+		t = next;
+	}
+	return first;
+}
+
+/* Task allocation */
+
+static work_t *slab_alloc(_threadpool *pool)
+{
+	slab_t *slab = (slab_t *) malloc(sizeof(slab_t));
+	int i;
+
+	if (slab == NULL)
+		return NULL;
+
+	/* Caller holds alloc_lock. */
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	for (i = 1; i < TASK_SLAB - 1; i++)
+		slab->tasks[i].next = &slab->tasks[i + 1];
+	slab->tasks[TASK_SLAB - 1].next = pool->free_list;
+	pool->free_list = &slab->tasks[1];
+
+	return &slab->tasks[0];
+}
+
+static work_t *task_alloc(_threadpool *pool)
+{
+	worker_t *self = current_worker;
+	work_t *t;
+	int n;
+
+	if (self && self->free_list)
+	{
+		t = self->free_list;
+		self->free_list = t->next;
+		self->num_free--;
+		return t;
+	}
+
+	pthread_mutex_lock(&pool->alloc_lock);
+	if ((t = pool->free_list) == NULL)
+		t = slab_alloc(pool);
+	else
+		pool->free_list = t->next;
+
+	/* Restock the worker's list while we hold the lock. */
+	for (n = 0; self && pool->free_list && n < TASK_SLAB; n++)
+	{
+		work_t *f = pool->free_list;
+		pool->free_list = f->next;
+		f->next = self->free_list;
+		self->free_list = f;
+		self->num_free++;
+	}
+	pthread_mutex_unlock(&pool->alloc_lock);
+
+	return t;
+}
+
+static void task_free(_threadpool *pool, work_t *t)
+{
+	worker_t *self = current_worker;
+
+	if (self && self->num_free < LOCAL_FREE_MAX)
+	{
+		t->next = self->free_list;
+		self->free_list = t;
+		self->num_free++;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->alloc_lock);
+	t->next = pool->free_list;
+	pool->free_list = t;
+	pthread_mutex_unlock(&pool->alloc_lock);
+}
+
+struct cleanup_arg {
+	_threadpool *pool;
+	worker_t *self;
+	work_t *work;
+};
+
 static void countdown(void *arg)
 {
-	_threadpool *pool = (_threadpool *)arg;
+	struct cleanup_arg *c = (struct cleanup_arg *)arg;
+	_threadpool *pool = c->pool;
+
+	if (pool->fini)
+		pool->fini(c->self->context);
+	current_worker = NULL;
 
-	pthread_mutex_lock(&pool->qlock);
-	pool->num_threads_alive--;
-	pthread_mutex_unlock(&pool->qlock);
+	__atomic_sub_fetch(&pool->num_threads_alive, 1, __ATOMIC_RELEASE);
+}
+
+/* A task has returned, or exited its thread; wake a drainer waiting
+   for the last one.  The seq_cst pair running/draining makes sure that
+   either we see the drainer or it sees running at zero. */
+static void task_done(_threadpool *pool)
+{
+	if (__atomic_sub_fetch(&pool->running, 1, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n(&pool->draining, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_broadcast(&pool->drain_cond);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
 }
 
 static void cleanup(void *arg)
 {
-	work_t *work = (work_t *)arg;
-	free(work);
+	struct cleanup_arg *c = (struct cleanup_arg *)arg;
+
+	/* The worker is going away; give the task back to everyone. */
+	current_worker = NULL;
+	task_free(c->pool, c->work);
+	task_done(c->pool);
 }
 
-/* This function is the work function of the thread */
-void *do_work(threadpool p)
+/* Find a task: our own deque, our inbox, then random victims. */
+static work_t *find_work(_threadpool *pool, worker_t *self)
 {
-    _threadpool *pool = (_threadpool *) p;
-    work_t *cur = NULL;	/* The q element */
-    int k;
-	
-	pthread_cleanup_push(countdown, pool);
-    while(1) {
-/*        pool->qsize = pool->qsize;  */
-        pthread_mutex_lock(&(pool->qlock));  /* get the q lock. */
-
-        while ( pool->qsize == 0) {	/* if the size is 0 then wait. */
-            if(pool->shutdown) {
-                pthread_mutex_unlock(&(pool->qlock));
-                pthread_exit(NULL);
-            }
-            /* wait until the condition says its no emtpy and give up the lock. */
-            pthread_mutex_unlock(&(pool->qlock));  /* get the qlock. */
-            pthread_cond_wait(&(pool->q_not_empty), &(pool->qlock));
-            /* check to see if in shutdown mode. */
-            if(pool->shutdown) {
-                pthread_mutex_unlock(&(pool->qlock));
-                pthread_exit(NULL);
-            }
-        }
+	work_t *t;
+	int round, i;
 
-        cur = pool->qhead;	/* set the cur variable. */
+	if ((t = deque_pop(self)) != NULL)
+		return t;
+	if ((t = adopt(self, inbox_take(self))) != NULL)
+		return t;
 
-		pthread_cleanup_push(cleanup, cur);
+	for (round = 0; round < STEAL_ROUNDS; round++)
+	{
+		int start = next_random(&self->seed) % pool->num_threads;
 
-        pool->qsize--;		/* decriment the size. */
+		for (i = 0; i < pool->num_threads; i++)
+		{
+			worker_t *victim = pool->workers[(start + i) % pool->num_threads];
+
+			if (victim == self)
+				continue;
+			if ((t = deque_steal(victim)) != NULL)
+				return t;
+			if ((t = adopt(self, inbox_take(victim))) != NULL)
+				return t;
+		}
+	}
+	return NULL;
+}
 
-        if(pool->qsize == 0) {
-            pool->qhead = NULL;
-            pool->qtail = NULL;
-        } else {
-            pool->qhead = cur->next;
-        }
+/* This function is the work function of the thread */
+void *do_work(void *p)
+{
+	struct worker_arg *warg = (struct worker_arg *) p;
+    _threadpool *pool = warg->pool;
+	worker_t *self = warg->self;
+	struct cleanup_arg c;
+    work_t *cur = NULL;	/* The q element */
 
-        if(pool->qsize == 0 && ! pool->shutdown) {
-            /* the q is empty again, now signal that its empty. */
-            pthread_cond_signal(&(pool->q_empty));
-        }
-        pthread_mutex_unlock(&(pool->qlock));
-        (cur->routine) (cur->arg);   /* actually do work. */
-        free(cur);						/* free the work storage. */
+	free(warg);
+	current_worker = self;
+	c.pool = pool;
+	c.self = self;
 
+	if (pool->init)
+		self->context = pool->init(self->index, pool->init_arg);
+
+	pthread_cleanup_push(countdown, &c);
+    while(1) {
+		if (__atomic_load_n(&pool->paused, __ATOMIC_ACQUIRE))
+			cur = NULL;
+		else
+			cur = find_work(pool, self);
+
+		if (cur == NULL) {
+			/* Sleep until dispatch sees us; pending is re-checked
+			   under the lock so that no wakeup is lost. */
+			pthread_mutex_lock(&pool->idle_lock);
+			__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+			while ((__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 ||
+					pool->paused) && !pool->shutdown)
+				pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+			__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+			if (pool->shutdown) {
+				pthread_mutex_unlock(&pool->idle_lock);
+				break;
+			}
+			pthread_mutex_unlock(&pool->idle_lock);
+			continue;
+		}
+
+		/* Counted as running before it stops being pending, so that a
+		   drainer never sees both at zero in between. */
+		__atomic_add_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&pool->cancelled, __ATOMIC_ACQUIRE)) {
+			task_free(pool, cur);
+			task_done(pool);
+			continue;
+		}
+
+		c.work = cur;
+		pthread_cleanup_push(cleanup, &c);
+        (cur->routine) (cur->arg);   /* actually do work. */
 		pthread_cleanup_pop(0);
+
+		task_free(pool, cur);
+		task_done(pool);
     }
-	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(1);
+
+	return NULL;
 }
 
 int get_num_thread_alive(threadpool p)
 {
 	_threadpool *pool = (_threadpool *)p;
-	int ret;
 
-	pthread_mutex_lock(&pool->qlock);
-	ret = pool->num_threads_alive;
-	pthread_mutex_unlock(&pool->qlock);
-		
-	return ret;	
+	return __atomic_load_n(&pool->num_threads_alive, __ATOMIC_ACQUIRE);
 }
 
 threadpool create_threadpool(int num_threads_in_pool)
+{
+	return create_threadpool_with_context(num_threads_in_pool,
+										  NULL, NULL, NULL);
+}
+
+threadpool create_threadpool_with_context(int num_threads_in_pool,
+										  worker_init_fn init,
+										  worker_fini_fn fini,
+										  void *arg)
 {
     _threadpool *pool = NULL;
     int i;
@@ -131,42 +476,72 @@ threadpool create_threadpool(int num_threads_in_pool)
     }
 
     pool->threads = (pthread_t *) malloc (sizeof(pthread_t) * num_threads_in_pool);
+	pool->workers = (worker_t **) calloc(num_threads_in_pool, sizeof(worker_t *));
 
-    if(!pool->threads) {
+    if(!pool->threads || !pool->workers) {
         fprintf(stderr, "Out of memory creating a new threadpool!\n");
         return NULL;
     }
 
     pool->num_threads = num_threads_in_pool; /* set up structure members */
-    pool->qsize = 0;
-    pool->qhead = NULL;
-    pool->qtail = NULL;
     pool->shutdown = 0;
-    pool->dont_accept = 0;
+	pool->dispatch_seed = 0x9e3779b9;
+	pool->init = init;
+	pool->fini = fini;
+	pool->init_arg = arg;
+
     /* initialize mutex and condition variables. */
-    if(pthread_mutex_init(&pool->qlock, NULL)) {
+    if(pthread_mutex_init(&pool->idle_lock, NULL) ||
+	   pthread_mutex_init(&pool->alloc_lock, NULL)) {
         fprintf(stderr, "Mutex initiation error!\n");
         return NULL;
     }
-    if(pthread_cond_init(&(pool->q_empty), NULL)) {
-        fprintf(stderr, "CV initiation error!\n");
-        return NULL;
-    }
-    if(pthread_cond_init(&(pool->q_not_empty), NULL)) {
+    if(pthread_cond_init(&(pool->idle_cond), NULL) ||
+	   pthread_cond_init(&pool->pause_cond, NULL)) {
         fprintf(stderr, "CV initiation error!\n");
         return NULL;
     }
-	
+	{
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		if (pthread_cond_init(&pool->drain_cond, &attr)) {
+			fprintf(stderr, "CV initiation error!\n");
+			return NULL;
+		}
+		pthread_condattr_destroy(&attr);
+	}
+	if (pipe(pool->cancel_pipe) < 0) {
+		perror("Can't create the pool's cancel pipe");
+		return NULL;
+	}
+
+	for (i = 0; i < num_threads_in_pool; i++) {
+		pool->workers[i] = (worker_t *) calloc(1, sizeof(worker_t));
+		if (!pool->workers[i]) {
+			fprintf(stderr, "Out of memory creating a new threadpool!\n");
+			return NULL;
+		}
+		pool->workers[i]->index = i;
+		pool->workers[i]->pool = pool;
+		pool->workers[i]->seed = 2654435761u * (i + 1);
+	}
+
+	pool->num_threads_alive = num_threads_in_pool;
+
     /* make threads */
     for (i = 0; i < num_threads_in_pool; i++) {
-        if(pthread_create(&(pool->threads[i]), NULL, do_work, pool)) {
+		struct worker_arg *warg = (struct worker_arg *) malloc(sizeof(*warg));
+
+		warg->pool = pool;
+		warg->self = pool->workers[i];
+        if(pthread_create(&(pool->threads[i]), NULL, do_work, warg)) {
             fprintf(stderr, "Thread initiation error!\n");
             return NULL;
         }
     }
 
-	pool->num_threads_alive = num_threads_in_pool;
-
     return (threadpool) pool;
 }
 
@@ -175,13 +550,11 @@ void dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
               void *arg)
 {
     _threadpool *pool = (_threadpool *) from_me;
+	worker_t *self = current_worker;
     work_t *cur;
-    int k;
-
-    k = pool->qsize;
 
     /* make a work queue element. */
-    cur = (work_t *) malloc(sizeof(work_t));
+    cur = task_alloc(pool);
     if(cur == NULL) {
         fprintf(stderr, "Out of memory creating a work struct!\n");
         return;
@@ -191,22 +564,31 @@ void dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
     cur->arg = arg;
     cur->next = NULL;
 
-    pthread_mutex_lock(&(pool->qlock));
+	/* A draining or cancelled pool takes nothing new. */
+	if (__atomic_load_n(&pool->draining, __ATOMIC_ACQUIRE)) {
+		task_free(pool, cur);
+		return;
+	}
 
-    if(pool->dont_accept) { /* Just incase someone is trying to queue more */
-        free(cur); /* work structs. */
-        return;
-    }
-    if(pool->qsize == 0) {
-        pool->qhead = cur;  /* set to only one */
-        pool->qtail = cur;
-        pthread_cond_signal(&(pool->q_not_empty));  /* I am not empty. */
-    } else {
-        pool->qtail->next = cur;	/* add to end; */
-        pool->qtail = cur;
-    }
-    pool->qsize++;
-    pthread_mutex_unlock(&(pool->qlock));  /* unlock the queue. */
+	/* Workers keep what they spawn; anyone else hands the task to a
+	   random worker. */
+	if (self == NULL || !deque_push(self, cur)) {
+		unsigned int r;
+
+		if (self)
+			r = self->index;
+		else
+			r = __atomic_add_fetch(&pool->dispatch_seed, 0x9e3779b9,
+								   __ATOMIC_RELAXED) >> 16;
+		inbox_push(pool->workers[r % pool->num_threads], cur);
+	}
+
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_signal(&pool->idle_cond);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
 }
 
 int get_thread_id(threadpool in_me, pthread_t thread)
@@ -214,12 +596,135 @@ int get_thread_id(threadpool in_me, pthread_t thread)
 	_threadpool *pool = (_threadpool *) in_me;
 	int i;
 
+	/* Asking about ourselves is the common case. */
+	if (current_worker && pthread_equal(thread, pthread_self()) &&
+		pool->workers[current_worker->index] == current_worker)
+		return current_worker->index;
+
 	for (i = 0; i < pool->num_threads; i++)
 		if (thread == pool->threads[i])
 			return i;
 	return -1;
 }
 
+int worker_index(void)
+{
+	return current_worker ? current_worker->index : -1;
+}
+
+void *worker_context(void)
+{
+	return current_worker ? current_worker->context : NULL;
+}
+
+int worker_cancelled(void)
+{
+	return current_worker &&
+		__atomic_load_n(&current_worker->pool->cancelled, __ATOMIC_ACQUIRE);
+}
+
+int worker_continue(void)
+{
+	worker_t *self = current_worker;
+	_threadpool *pool;
+	int go;
+
+	if (self == NULL)
+		return 1;
+	pool = self->pool;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	while (pool->paused && !pool->draining)
+		pthread_cond_wait(&pool->pause_cond, &pool->idle_lock);
+	go = !pool->draining;
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	return go;
+}
+
+void pause_threadpool(threadpool p)
+{
+	_threadpool *pool = (_threadpool *) p;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	__atomic_store_n(&pool->paused, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void resume_threadpool(threadpool p)
+{
+	_threadpool *pool = (_threadpool *) p;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	__atomic_store_n(&pool->paused, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_cond_broadcast(&pool->pause_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void cancel_threadpool(threadpool p)
+{
+	_threadpool *pool = (_threadpool *) p;
+	int first;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	first = !pool->cancelled;
+	__atomic_store_n(&pool->cancelled, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->draining, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->paused, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_cond_broadcast(&pool->pause_cond);
+	pthread_cond_broadcast(&pool->drain_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	/* Never read, so it stays readable for every poller. */
+	if (first && write(pool->cancel_pipe[1], "x", 1) < 0)
+		perror("Can't signal cancellation");
+}
+
+int drain_threadpool(threadpool p, double timeout)
+{
+	_threadpool *pool = (_threadpool *) p;
+	struct timespec ts;
+	int drained;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (time_t)timeout;
+	ts.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&pool->idle_lock);
+	__atomic_store_n(&pool->draining, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->paused, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_cond_broadcast(&pool->pause_cond);
+
+	while ((__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 ||
+			__atomic_load_n(&pool->running, __ATOMIC_SEQ_CST) > 0) &&
+		   !pool->cancelled)
+		if (pthread_cond_timedwait(&pool->drain_cond, &pool->idle_lock,
+								   &ts) != 0)
+			break;
+
+	drained = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n(&pool->running, __ATOMIC_SEQ_CST) == 0;
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	if (!drained)
+		cancel_threadpool(p);
+	return drained ? 0 : -1;
+}
+
+int get_cancel_fd(threadpool p)
+{
+	_threadpool *pool = (_threadpool *) p;
+
+	return pool->cancel_pipe[0];
+}
+
 
 void destroy_threadpool(threadpool destroyme)
 {
@@ -227,44 +732,36 @@ void destroy_threadpool(threadpool destroyme)
     void *nothing;
     int i = 0;
 
-    
-/*    pthread_mutex_lock(&(pool->qlock));
-    pool->dont_accept = 1;
-    while(pool->qsize != 0) {
-    	pthread_cond_wait(&(pool->q_empty),&(pool->qlock));  //wait until the q is empty.
-    }
-    pool->shutdown = 1;  //allow shutdown
-    pthread_cond_broadcast(&(pool->q_not_empty));  //allow code to return NULL;
-    pthread_mutex_unlock(&(pool->qlock));
-
-    //kill everything.
-    for(;i < pool->num_threads;i++) {
-    //		pthread_cond_broadcast(&(pool->q_not_empty));
-    //allowcode to return NULL;/
-    	pthread_join(pool->threads[i],&nothing);
-    }
-    */
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
 
 	for(i = 0; i < pool->num_threads; i++)
 	{
 		pthread_join(pool->threads[i], &nothing);
 	}
 
+	/* Tasks never started live in the slabs too. */
+	while (pool->slabs)
 	{
-		work_t *elem = pool->qhead;
-		while (elem)
-		{
-			work_t *next = elem->next;
-			free(elem);
-			elem = next;
-		}	
-	}	
+		slab_t *next = pool->slabs->next;
+		free(pool->slabs);
+		pool->slabs = next;
+	}
 
+	for (i = 0; i < pool->num_threads; i++)
+		free(pool->workers[i]);
+	free(pool->workers);
     free(pool->threads);
 
-    pthread_mutex_destroy(&(pool->qlock));
-    pthread_cond_destroy(&(pool->q_empty));
-    pthread_cond_destroy(&(pool->q_not_empty));
+    pthread_mutex_destroy(&(pool->idle_lock));
+    pthread_mutex_destroy(&(pool->alloc_lock));
+    pthread_cond_destroy(&(pool->idle_cond));
+	pthread_cond_destroy(&pool->pause_cond);
+	pthread_cond_destroy(&pool->drain_cond);
+	close(pool->cancel_pipe[0]);
+	close(pool->cancel_pipe[1]);
 
 	free(pool);
     return;
@@ -32,6 +32,16 @@ typedef void *threadpool;
 
 typedef void (*dispatch_fn)(void *);
 
+/*
+ * "worker_init_fn" builds the private context of pool thread
+ * "index"; it runs on that thread before it takes any task.
+ * "worker_fini_fn" tears the context down when the thread exits.
+ */
+
+typedef void *(*worker_init_fn)(int index, void *arg);
+
+typedef void (*worker_fini_fn)(void *context);
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -39,14 +49,25 @@ typedef void (*dispatch_fn)(void *);
  */
 threadpool create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_with_context is create_threadpool,
+ * but every thread first calls "init" with its index and
+ * "arg", and keeps what it returns as its context for
+ * worker_context.  "fini" gets the context back when the
+ * thread exits.  Either function may be NULL.
+ */
+threadpool create_threadpool_with_context(int num_threads_in_pool,
+					  worker_init_fn init,
+					  worker_fini_fn fini,
+					  void *arg);
+
 
 /**
- * dispatch sends a thread off to do some work.  If
- * all threads in the pool are busy, dispatch will
- * block until a thread becomes free and is dispatched.
- * 
- * Once a thread is dispatched, this function returns
- * immediately.
+ * dispatch queues a task for the pool and returns
+ * immediately; it never blocks.  Called from a pool
+ * thread, the task goes to that thread's own deque;
+ * called from anywhere else, it goes to a random
+ * thread.  Idle threads steal from busy ones.
  * 
  * The dispatched thread calls into the function
  * "dispatch_to_here" with argument "arg".
@@ -61,9 +82,55 @@ void dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
  */
 void destroy_threadpool(threadpool destroyme);
 
+/**
+ * pause_threadpool keeps threads from starting tasks,
+ * and holds tasks that call worker_continue, until
+ * resume_threadpool.  dispatch still queues.
+ */
+void pause_threadpool(threadpool p);
+
+void resume_threadpool(threadpool p);
+
+/**
+ * drain_threadpool stops the pool taking tasks and waits
+ * up to "timeout" seconds for the queued and running ones
+ * to finish.  It returns 0 if they did, else cancels the
+ * pool and returns -1.
+ */
+int drain_threadpool(threadpool p, double timeout);
+
+/**
+ * cancel_threadpool stops the pool taking tasks, drops
+ * the queued ones and tells the running ones to give up:
+ * worker_cancelled turns true and the descriptor from
+ * get_cancel_fd becomes readable, for tasks blocked in
+ * poll.  Tasks are never killed; they must notice.
+ */
+void cancel_threadpool(threadpool p);
+
+int get_cancel_fd(threadpool p);
+
 
 int get_thread_id(threadpool in_me, pthread_t thread);
 
+/**
+ * worker_index and worker_context describe the calling
+ * thread in constant time: its index in the pool and its
+ * context, or -1 and NULL when it is not a pool thread.
+ */
+int worker_index(void);
+
+void *worker_context(void);
+
+/**
+ * worker_continue is for tasks that loop: it waits while
+ * the pool is paused and returns 0 once it is draining or
+ * cancelled, when the task should return.
+ */
+int worker_continue(void);
+
+int worker_cancelled(void);
+
 int get_num_thread_alive(threadpool p);
 
 #endif
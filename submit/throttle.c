@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "throttle.h"
+#include "utils.h"
+
+/* Seconds per adjustment window, and the fewest fetches that make a
+   window worth judging. */
+#define THROTTLE_WINDOW 1.0
+#define THROTTLE_MIN_SAMPLES 8
+
+/* Latencies kept per window for the percentile. */
+#define THROTTLE_MAX_SAMPLES 1024
+
+/* Back off when this share of fetches fails ... */
+#define THROTTLE_ERROR_RATE 0.05
+
+/* ... or when p95 latency exceeds the best p95 by this factor. */
+#define THROTTLE_LATENCY_FACTOR 2.0
+
+#define THROTTLE_DECREASE 0.75
+
+struct throttle
+{
+	int min_limit;
+	int max_limit;
+	int limit;
+	int in_use;
+	int slow_start;
+
+	/* current window */
+	double window_start;
+	double samples[THROTTLE_MAX_SAMPLES];
+	int num_samples;
+	long completed;
+	long errors;
+	int saturated;	/* every slot was taken at some point */
+
+	double best_p95;
+
+	pthread_mutex_t lock;
+	pthread_cond_t slot_free;
+};
+
+struct throttle *throttle_new(int min_limit, int max_limit)
+{
+	struct throttle *t;
+
+	t = (struct throttle *)calloc(1, sizeof(struct throttle));
+	if (t == NULL)
+		return NULL;
+
+	if (min_limit < 1)
+		min_limit = 1;
+	if (max_limit < min_limit)
+		max_limit = min_limit;
+
+	t->min_limit = min_limit;
+	t->max_limit = max_limit;
+	t->limit = min_limit;
+	t->slow_start = 1;
+	t->window_start = now_seconds();
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->slot_free, NULL);
+
+	return t;
+}
+
+void throttle_delete(struct throttle *t)
+{
+	pthread_cond_destroy(&t->slot_free);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/* Wait for a free slot. */
+void throttle_acquire(struct throttle *t)
+{
+	pthread_mutex_lock(&t->lock);
+
+	while (t->in_use >= t->limit)
+		pthread_cond_wait(&t->slot_free, &t->lock);
+
+	if (++t->in_use == t->limit)
+		t->saturated = 1;
+
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* throttle_acquire without the wait: 1 if a slot was taken. */
+int throttle_try_acquire(struct throttle *t)
+{
+	int ok;
+
+	pthread_mutex_lock(&t->lock);
+
+	ok = t->in_use < t->limit;
+	if (ok && ++t->in_use == t->limit)
+		t->saturated = 1;
+
+	pthread_mutex_unlock(&t->lock);
+
+	return ok;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Judge the window that just ended; called with the lock held. */
+static void adjust(struct throttle *t, double now)
+{
+	double elapsed = now - t->window_start;
+	double error_rate, p95;
+	int old = t->limit;
+
+	qsort(t->samples, t->num_samples, sizeof(double), compare_double);
+	p95 = t->num_samples ? t->samples[(t->num_samples * 95) / 100] : 0.0;
+	error_rate = (double)t->errors / t->completed;
+
+	if (t->best_p95 == 0.0 || (t->num_samples && p95 < t->best_p95))
+		t->best_p95 = p95;
+
+	if (error_rate > THROTTLE_ERROR_RATE ||
+		p95 > THROTTLE_LATENCY_FACTOR * t->best_p95)
+	{
+		t->limit = (int)(t->limit * THROTTLE_DECREASE);
+		t->slow_start = 0;
+	}
+	else if (t->saturated)
+		t->limit = t->slow_start ? 2 * t->limit : t->limit + 1;
+
+	if (t->limit < t->min_limit)
+		t->limit = t->min_limit;
+	if (t->limit > t->max_limit)
+		t->limit = t->max_limit;
+
+	if (t->limit != old)
+	{
+		printf("Concurrency %d -> %d: %.1f pages/s, p95 %.0f ms, "
+			   "%.1f%% errors\n", old, t->limit, t->completed / elapsed,
+			   p95 * 1000, error_rate * 100);
+		if (t->limit > old)
+			pthread_cond_broadcast(&t->slot_free);
+	}
+
+	/* Drifting baselines: let the best p95 age so that a slower
+	   network later on does not look like permanent overload. */
+	t->best_p95 *= 1.01;
+
+	t->window_start = now;
+	t->num_samples = 0;
+	t->completed = 0;
+	t->errors = 0;
+	t->saturated = t->in_use >= t->limit;
+}
+
+/* Give a slot back.  LATENCY is the fetch time in seconds, or negative
+   when no fetch was made; ERROR tells whether the fetch failed. */
+void throttle_release(struct throttle *t, double latency, int error)
+{
+	double now;
+
+	pthread_mutex_lock(&t->lock);
+
+	--t->in_use;
+	pthread_cond_signal(&t->slot_free);
+
+	if (latency >= 0.0)
+	{
+		if (t->num_samples < THROTTLE_MAX_SAMPLES)
+			t->samples[t->num_samples++] = latency;
+		t->completed++;
+		if (error)
+			t->errors++;
+
+		now = now_seconds();
+		if (now - t->window_start >= THROTTLE_WINDOW &&
+			t->completed >= THROTTLE_MIN_SAMPLES)
+			adjust(t, now);
+	}
+
+	pthread_mutex_unlock(&t->lock);
+}
+
+int throttle_limit(struct throttle *t)
+{
+	int limit;
+
+	pthread_mutex_lock(&t->lock);
+	limit = t->limit;
+	pthread_mutex_unlock(&t->lock);
+
+	return limit;
+}
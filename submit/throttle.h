@@ -0,0 +1,31 @@
+#ifndef _THROTTLE_H
+#define _THROTTLE_H
+
+/*
+ * Adaptive limit on the number of fetches in progress.
+ *
+ * Workers take a slot with throttle_acquire before fetching and give
+ * it back with throttle_release, reporting how long the fetch took and
+ * whether it failed.  Once per window the limit is adjusted, AIMD
+ * style: it doubles while nothing has gone wrong yet (slow start),
+ * then grows by one per window while the slots are all in use, and is
+ * cut by a quarter when the error rate climbs or the 95th percentile
+ * latency rises well above the best seen so far.  The limit always
+ * stays within the bounds given to throttle_new.
+ */
+
+struct throttle;
+
+extern struct throttle *throttle_new(int min_limit, int max_limit);
+
+extern void throttle_delete(struct throttle *t);
+
+extern void throttle_acquire(struct throttle *t);
+
+extern int throttle_try_acquire(struct throttle *t);
+
+extern void throttle_release(struct throttle *t, double latency, int error);
+
+extern int throttle_limit(struct throttle *t);
+
+#endif
@@ -1,12 +1,15 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <regex.h>
+#include <ctype.h>
 
 #include "url.h"
 #include "utils.h"
+#include "hash.h"
 
 #define HTTP_DEFAULT_PORT 80
 
@@ -74,6 +77,19 @@ int url_simplify(char *url)
 	return t != h;	
 }
 
+/* 64-bit fingerprint of a canonical (simplified) URL.  The
+   all-bits-set value is folded onto its neighbour: webgraph_add_links
+   dedupes a batch in a set of fingerprints plus one, where 0 marks an
+   empty slot. */
+url_fp_t url_fingerprint(const char *url)
+{
+	url_fp_t fp = hash_string64(url);
+
+	if (fp == ~(url_fp_t)0)
+		--fp;
+	return fp;
+}
+
 char *uri_merge(const char *base, const char *link)
 {
 	int linklength;
@@ -205,13 +221,37 @@ char *uri_merge(const char *base, const char *link)
 
 
 
-struct url_queue *url_queue_new(void)
+#define URL_QUEUE_MIN_CAPACITY 1024
+
+struct url_queue *url_queue_new(long capacity, const char *spill_dir,
+								struct spill_service *svc)
 {
 	struct url_queue *queue = (struct url_queue *)
 		calloc(1, sizeof(struct url_queue));
+	unsigned long size, i;
+
+	if (queue == NULL)
+		return NULL;
+
+	size = URL_QUEUE_MIN_CAPACITY;
+	while (size < (unsigned long)capacity)
+		size <<= 1;
+
+	queue->ring = (struct queue_cell *)calloc(size, sizeof(struct queue_cell));
+	if (queue->ring == NULL)
+	{
+		free(queue);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++)
+		queue->ring[i].seq = i;
+	queue->mask = size - 1;
 	
-	if (pthread_mutex_init(&queue->qlock, NULL) != 0)
+	queue->overflow = spill_new(spill_dir, svc);
+	if (queue->overflow == NULL)
 	{
+		free(queue->ring);
 		free(queue);
 		return NULL;
 	}
@@ -221,79 +261,137 @@ struct url_queue *url_queue_new(void)
 
 void url_queue_delete(struct url_queue *queue)
 {
-	pthread_mutex_destroy(&queue->qlock);	
+	spill_delete(queue->overflow);
+	free(queue->ring);
 	free(queue);
 }
 
-void url_enqueue(struct url_queue *queue, 
-						const char *url,
-						const char *referer,
-						int depth)
+static void update_maxcount(struct url_queue *queue)
 {
-	struct queue_element *qel = (struct queue_element *)
-		malloc(sizeof(struct queue_element));
-	qel->url = url;
-	qel->referer = referer;
-	qel->depth = depth;
-	qel->next = NULL;
-	
-	pthread_mutex_lock(&queue->qlock);
+	int count = url_get_queue_count(queue);
+	int max = __atomic_load_n(&queue->maxcount, __ATOMIC_RELAXED);
 
-	++queue->count;
-	if (queue->count > queue->maxcount)
-		queue->maxcount = queue->count;
+	while (count > max &&
+		   !__atomic_compare_exchange_n(&queue->maxcount, &max, count, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
 
-	if (queue->tail)
-		queue->tail->next = qel;
-	queue->tail = qel;
-	
-	if (!queue->head)
-		queue->head = queue->tail;
+static int ring_push(struct url_queue *queue, const struct url_entry *e)
+{
+	struct queue_cell *cell;
+	unsigned long pos;
+	long dif;
+
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &queue->ring[pos & queue->mask];
+		dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1,
+						1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+			return 0;	/* full */
+		else
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	}
+
+	cell->entry = *e;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-	pthread_mutex_unlock(&queue->qlock);
+	return 1;
 }
 
-int url_dequeue(struct url_queue *queue,
-					   char **url,
-					   char **referer,
-					   int *depth)
+static int ring_pop(struct url_queue *queue, struct url_entry *e)
 {
-	struct queue_element *qel;
+	struct queue_cell *cell;
+	unsigned long pos;
+	long dif;
 
-	pthread_mutex_lock(&queue->qlock);
+	pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &queue->ring[pos & queue->mask];
+		dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+			(long)(pos + 1);
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1,
+						1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+			return 0;	/* empty */
+		else
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	}
 
-	qel = queue->head;
-	if (!qel)
+	*e = cell->entry;
+	__atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* Move overflowed elements back into the ring as space frees up, so
+   the queue returns to the lock-free path after a burst. */
+#define URL_QUEUE_REFILL_BATCH 64
+
+static int refill_one(void *arg, const struct url_entry *e)
+{
+	return ring_push((struct url_queue *)arg, e);
+}
+
+void url_enqueue(struct url_queue *queue, const struct url_entry *e)
+{
+	/* Once anything has overflowed, new elements follow it until it
+	   drains so that they stay behind the older ones. */
+	if (spill_count(queue->overflow) != 0 ||
+		!ring_push(queue, e))
 	{
-		pthread_mutex_unlock(&queue->qlock);
-		return 0;
+		spill_push(queue->overflow, e);
 	}
 
-	queue->head = queue->head->next;
-	if (!queue->head)
-		queue->tail = NULL;
+	update_maxcount(queue);
+}
 
-	*url = qel->url;
-	*referer = qel->referer;
-	*depth = qel->depth;
-		
-	--queue->count;
+/* Returns 0 if the queue is empty, or if its oldest elements are
+   still on disk; see spill_pop. */
+int url_dequeue(struct url_queue *queue, struct url_entry *e)
+{
+	if (ring_pop(queue, e))
+	{
+		if (spill_count(queue->overflow) != 0)
+			spill_drain(queue->overflow, refill_one, queue,
+						URL_QUEUE_REFILL_BATCH);
+		return 1;
+	}
 
-	free(qel);
-	
-	pthread_mutex_unlock(&queue->qlock);
+	if (spill_count(queue->overflow) == 0)
+		return 0;
 
-	return 1;
+	return spill_pop(queue->overflow, e);
 }
 
+/* Approximate under concurrent updates; takes no lock. */
 int url_get_queue_count(struct url_queue *queue)
 {
-	int ret;
-	pthread_mutex_lock(&queue->qlock);
-	ret = queue->count;
-	pthread_mutex_unlock(&queue->qlock);
+	unsigned long enq, deq;
+	long overflow;
+
+	deq = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	enq = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	overflow = spill_count(queue->overflow);
+
+	if (enq < deq)
+		enq = deq;
 
-	return ret;
+	return (int)(enq - deq) + overflow;
 }
 
 static const char *parse_errors[] = {
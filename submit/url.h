@@ -1,6 +1,7 @@
 #ifndef _URL_H
 #define _URL_H
 #include <pthread.h>
+#include "spill.h"
 
 typedef struct url
 {
@@ -18,40 +19,51 @@ struct url_vec
 	struct url_vec *next;
 };
 
-struct queue_element
+/* One slot of the lock-free ring.  SEQ tells producers and consumers
+   whose turn it is (Vyukov's bounded MPMC queue). */
+struct queue_cell
 {
-	const char *url;
-	const char *referer;
-	int depth;
-
-	struct queue_element *next;
+	unsigned long seq;
+	struct url_entry entry;
 };
 
+#define URL_QUEUE_CACHELINE 64
+
 struct url_queue
 {
-	struct queue_element *head;
-	struct queue_element *tail;
-	int count, maxcount;
-	pthread_mutex_t qlock;
+	struct queue_cell *ring;
+	unsigned long mask;
+
+	char pad0[URL_QUEUE_CACHELINE];
+	unsigned long enqueue_pos;
+	char pad1[URL_QUEUE_CACHELINE];
+	unsigned long dequeue_pos;
+	char pad2[URL_QUEUE_CACHELINE];
+
+	/* Elements that did not fit in the ring, possibly spilled to
+	   disk.  Only touched when the ring is full, or while older
+	   overflowed elements are still waiting there. */
+	struct url_spill *overflow;
+	int maxcount;
 };
 
+typedef unsigned long long url_fp_t;
+
 extern int url_simplify(char *url);
 
+extern url_fp_t url_fingerprint(const char *url);
+
 extern char *uri_merge(const char *base, const char *link);
 
-extern struct url_queue *url_queue_new(void);
+extern struct url_queue *url_queue_new(long capacity,
+									   const char *spill_dir,
+									   struct spill_service *svc);
 
 extern void url_queue_delete(struct url_queue *queue);
 
-extern void url_enqueue(struct url_queue *queue,
-				   const char *url,
-				   const char *referer,
-				   int depth);
+extern void url_enqueue(struct url_queue *queue, const struct url_entry *e);
 
-extern int url_dequeue(struct url_queue *queue,
-				 	   char **url,
-					   char **referer,
-					   int *depth);
+extern int url_dequeue(struct url_queue *queue, struct url_entry *e);
 
 
 
@@ -61,4 +73,12 @@ extern int url_get_queue_count(struct url_queue *queue);
 
 extern url_t *url_parse(const char *url, int *error); 
 
+extern void url_free(url_t *url);
+
+extern int url_sanity_check(const char *url);
+
+extern struct url_vec *extract_urls(const char *content);
+
+extern void free_url_vec(struct url_vec *l);
+
 #endif
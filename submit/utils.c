@@ -1,6 +1,7 @@
 #include "utils.h"
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 char *strpbrk_or_eos(const char *s,
 		const char *accept)
@@ -19,4 +20,10 @@ char *strdupdelim(const char *beg, const char *end)
 	return res;
 }
 
-
+/* Seconds on the monotonic clock, for measuring intervals. */
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -21,5 +21,7 @@ extern char *strpbrk_or_eos(const char *s,
 
 extern char *strdupdelim(const char *beg, const char *end);
 
+extern double now_seconds(void);
+
 
 #endif
@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
@@ -6,27 +8,87 @@
 
 #include "webgraph.h"
 #include "hash.h"
+#include "cmap.h"
+#include "bloom.h"
+#include "url.h"
+#include "checkpoint.h"
+
+/* Target false-positive rate of the seen-set filter at the expected
+   number of URLs. */
+#define SEEN_FILTER_FP_RATE 0.01
+
+/* Shards of the seen-set and stripes of node locks: many more than
+   there are threads adding links, so that those seldom meet. */
+#define WEBGRAPH_SHARDS 64
+#define WEBGRAPH_STRIPES 64
+
+/* Nodes, indexed by id in lazily allocated chunks so that they never
+   move and can be read without a lock while the graph grows. */
+#define NODE_CHUNK_BITS 16
+#define NODE_CHUNK_SIZE (1L << NODE_CHUNK_BITS)
+#define NODE_MAX_CHUNKS 65536
+
+/* Node ID, which must have been allocated. */
+#define NODE(graph, id) \
+	(&(graph)->chunks[(id) >> NODE_CHUNK_BITS][(id) & (NODE_CHUNK_SIZE - 1)])
+
+/* The seen-set, from URL strings or fingerprints to ids stored inline.
+   Fingerprints are well mixed already and hash to themselves. */
+#define URL_EQUAL(a, b) (strcmp((a), (b)) == 0)
+#define FP_HASH(fp) ((unsigned long)(fp))
+#define FP_EQUAL(a, b) ((a) == (b))
+
+HTABLE_DEFINE(url_ids, const char *, long, hash_string, URL_EQUAL)
+HTABLE_DEFINE(fp_ids, url_fp_t, long, FP_HASH, FP_EQUAL)
+
+CMAP_DEFINE(url_map, url_ids, const char *, long)
+CMAP_DEFINE(fp_map, fp_ids, url_fp_t, long)
+
+struct webgraph_node
+{
+	const char *url;
+	struct vec_in_links *in_links_head;
+	struct vec_in_links *in_links_tail;
+	long num_out_links;	/* updated atomically */
+	long num_in_links;	/* under the node's stripe lock */
+};
 
-#define SETBIT(a, n) (a[n/CHAR_BIT] |= (1<<(n%CHAR_BIT)))
-#define CLRBIT(a, n) (a[n/CHAR_BIT] &= ~(1<<(n%CHAR_BIT)))
-#define GETBIT(a, n) (a[n/CHAR_BIT] & (1<<(n%CHAR_BIT)))
+/* The lock over the in-links of the nodes whose ids are equal to its
+   index modulo WEBGRAPH_STRIPES, and the log of the edges into them. */
+struct webgraph_stripe
+{
+	pthread_mutex_t lock;
+
+	/* Edges added since the last checkpoint; kept only with
+	   WEBGRAPH_CHECKPOINT. */
+	struct checkpoint_link *link_log;
+	long link_log_len;
+	long link_log_cap;
+};
 
 struct webgraph
 {
-	long size;
-	long max_size;
+	long size;	/* ids handed out, updated atomically */
+	int flags;
 
-	struct hash_table *url_blacklist;
+	/* URL -> id.  Keyed by the URL string, or by its fingerprint when
+	   WEBGRAPH_FINGERPRINT_KEYS is set; only that one is made. */
+	struct url_map *url_blacklist;
+	struct fp_map *fp_blacklist;
+	struct bloom_filter *seen_filter;
 
-	const char **url_string;
-	struct vec_in_links **in_links_head;
-	struct vec_in_links **in_links_tail;
-	long *num_out_links;
-	unsigned char *dangling_pages;
+	struct webgraph_node **chunks;
+	struct webgraph_stripe stripes[WEBGRAPH_STRIPES];
 
 	double *pr;	
 
+	webgraph_link_hook link_hook;
+	void *link_hook_arg;
+
+	/* Serializes checkpoints and restores.  The number of nodes already
+	   in the checkpoint is kept under it. */
 	pthread_mutex_t g_lock;	
+	long saved_nodes;
 };
 
 struct vec_in_links
@@ -46,11 +108,44 @@ void vec_in_links_free(struct vec_in_links *l)
 	}
 }
 
+/* Node ID, allocating its chunk if need be. */
+static struct webgraph_node *node(struct webgraph *graph, long id)
+{
+	long chunk = id >> NODE_CHUNK_BITS;
+	struct webgraph_node *c;
+
+	if (id < 0 || chunk >= NODE_MAX_CHUNKS)
+		return NULL;
+
+	c = __atomic_load_n(&graph->chunks[chunk], __ATOMIC_ACQUIRE);
+	if (c == NULL)
+	{
+		struct webgraph_node *expected = NULL;
+
+		c = (struct webgraph_node *)
+			calloc(NODE_CHUNK_SIZE, sizeof(struct webgraph_node));
+		if (c == NULL)
+			return NULL;
+		if (!__atomic_compare_exchange_n(&graph->chunks[chunk], &expected, c,
+										 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			free(c);
+			c = expected;
+		}
+	}
+
+	return &c[id & (NODE_CHUNK_SIZE - 1)];
+}
+
+static long graph_size(struct webgraph *graph)
+{
+	return __atomic_load_n(&graph->size, __ATOMIC_ACQUIRE);
+}
 
-webgraph_handle webgraph_new(long size)
+webgraph_handle webgraph_new(long size, int flags)
 {
 	struct webgraph *graph;
-	unsigned int num_chars;
+	int i;
 
 	graph = (struct webgraph *)calloc(1, sizeof(struct webgraph));
 
@@ -60,172 +155,650 @@ webgraph_handle webgraph_new(long size)
 		return NULL;
 	}
 
-	graph->max_size = size;
 	graph->size = 0;
+	graph->flags = flags;
+
+	if (flags & WEBGRAPH_FINGERPRINT_KEYS)
+		graph->fp_blacklist = fp_map_new(WEBGRAPH_SHARDS, size);
+	else
+		graph->url_blacklist = url_map_new(WEBGRAPH_SHARDS, size);
+	graph->seen_filter = bloom_new(size, SEEN_FILTER_FP_RATE);
+	graph->chunks = (struct webgraph_node **)
+		calloc(NODE_MAX_CHUNKS, sizeof(struct webgraph_node *));
+
+	if ((graph->url_blacklist == NULL && graph->fp_blacklist == NULL) ||
+		graph->seen_filter == NULL || graph->chunks == NULL)
+	{
+		if (graph->url_blacklist)
+			url_map_delete(graph->url_blacklist);
+		if (graph->fp_blacklist)
+			fp_map_delete(graph->fp_blacklist);
+		if (graph->seen_filter)
+			bloom_delete(graph->seen_filter);
+		free(graph->chunks);
+		pthread_mutex_destroy(&graph->g_lock);
+		free(graph);
+		return NULL;
+	}
 
-	graph->url_blacklist = make_string_hash_table(size);
-
-	graph->in_links_head = 
-		(struct vec_in_links **)calloc(size, 
-								sizeof(struct vec_in_links *));
-
-	graph->in_links_tail =
-		(struct vec_in_links **)calloc(size,
-								sizeof(struct vec_in_links *));
+	for (i = 0; i < WEBGRAPH_STRIPES; i++)
+		pthread_mutex_init(&graph->stripes[i].lock, NULL);
 
-	graph->url_string = (const char **)calloc(size, sizeof(const char *));
+	webgraph_resize(graph, size);
 
-	graph->num_out_links = (long *)calloc(size, sizeof(long));
-	
-	num_chars = size / CHAR_BIT + 1;
-	graph->dangling_pages =
-		(unsigned char *)malloc(num_chars * sizeof(char));
-	memset(graph->dangling_pages, 0xFF, num_chars * sizeof(char)); 
-	
 	return (webgraph_handle) graph;				 
 }
 
 long webgraph_get_size(webgraph_handle handle)
 {
 	struct webgraph *graph = (struct webgraph *)handle;
-	long size;
-	
-	pthread_mutex_lock(&graph->g_lock);
-	size = graph->size;
-	pthread_mutex_unlock(&graph->g_lock);
-	
-	return size;
+
+	return graph_size(graph);
 }
 
-void webgraph_add_link(
-						  webgraph_handle handle,
-						  const char *dest,
-						  const char *src
-						 )
+/* Look URL up in the seen-set. */
+static int lookup_id(struct webgraph *graph,
+					 const char *url,
+					 url_fp_t fp,
+					 long *id)
 {
-	struct webgraph *graph = (struct webgraph *)handle;		
-	
-	long *src_id;
-	long *dest_id;
+	if (graph->fp_blacklist)
+		return fp_map_get(graph->fp_blacklist, fp, id);
+	return url_map_get(graph->url_blacklist, url, id);
+}
 
-	pthread_mutex_lock(&graph->g_lock);
-	
-	src_id = hash_table_get(graph->url_blacklist, src);
-	dest_id = hash_table_get(graph->url_blacklist, dest);
+double webgraph_filter_fp_rate(webgraph_handle handle)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+	return bloom_measured_fp_rate(graph->seen_filter);
+}
 
-	assert(src_id != NULL);
-	assert(dest_id != NULL);
+struct insert_arg
+{
+	struct webgraph *graph;
+	const char *url;
+	url_fp_t fp;
+	long id;
+};
+
+/* Give the URL in A the next id and a node.  Called under the
+   seen-set shard lock, so the node is complete before anyone can find
+   it.  Returns the node's copy of the URL, or NULL if it cannot be
+   allocated. */
+static const char *new_node(struct insert_arg *a)
+{
+	struct webgraph *graph = a->graph;
+	char *url = strdup(a->url);
+	long id;
 
-	if (*src_id < graph->max_size && *dest_id < graph->max_size)
+	if (url == NULL)
+		return NULL;
+
+	/* Take the id only once its node is there, so that a failure
+	   leaves no id without a URL behind.  Chunks are never freed. */
+	id = __atomic_load_n(&graph->size, __ATOMIC_ACQUIRE);
+	do
 	{
-		struct vec_in_links *entry;
-		entry = (struct vec_in_links *)
-			calloc(1, sizeof(struct vec_in_links));
-		entry->url_id = *src_id;
-		
-		if (graph->in_links_head[*dest_id] == NULL)
-			graph->in_links_head[*dest_id] = entry;
-		else
-			graph->in_links_tail[*dest_id]->next = entry;
-		graph->in_links_tail[*dest_id] = entry;
+		if (node(graph, id) == NULL)
+		{
+			free(url);
+			return NULL;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&graph->size, &id, id + 1, 0,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	a->id = id;
+	__atomic_store_n(&node(graph, id)->url, url, __ATOMIC_RELEASE);
+	bloom_add_hash(graph->seen_filter, a->fp);
 
-		if (GETBIT(graph->dangling_pages, *src_id))
-			CLRBIT(graph->dangling_pages, *src_id);
-			
-		++graph->num_out_links[*src_id];	
+	return url;
+}
+
+/* Make the seen-set entry of the URL in ARG (a struct insert_arg),
+   keyed by the node's copy of it... */
+static int insert_url(void *arg, const char **key, long *value)
+{
+	struct insert_arg *a = (struct insert_arg *)arg;
+
+	if ((*key = new_node(a)) == NULL)
+		return -1;
+	*value = a->id;
+	return 0;
+}
 
+/* ...or by its fingerprint. */
+static int insert_fp(void *arg, url_fp_t *key, long *value)
+{
+	struct insert_arg *a = (struct insert_arg *)arg;
+
+	if (new_node(a) == NULL)
+		return -1;
+	*value = a->id;
+	return 0;
+}
+
+/* Find URL, adding it if absent.  Returns 1 if URL was added, or -1 if
+   it could not be. */
+static int lookup_or_insert(struct webgraph *graph,
+							const char *url,
+							url_fp_t fp,
+							long *id)
+{
+	struct insert_arg a;
+	int added;
+
+	a.graph = graph;
+	a.url = url;
+	a.fp = fp;
+
+	/* Fast path: the filter never misses a URL that was added, so on a
+	   negative answer there is nothing to look up and the URL goes
+	   straight to be inserted.  The shard's write lock still decides
+	   between racing inserts of it. */
+	if (!bloom_maybe_contains_hash(graph->seen_filter, fp))
+	{
+		if (graph->fp_blacklist)
+			return fp_map_insert_absent(graph->fp_blacklist, fp,
+										insert_fp, &a, id);
+		return url_map_insert_absent(graph->url_blacklist, url,
+									 insert_url, &a, id);
 	}
 
-	pthread_mutex_unlock(&graph->g_lock);	
+	if (graph->fp_blacklist)
+		added = fp_map_get_or_insert(graph->fp_blacklist, fp,
+									 insert_fp, &a, id);
+	else
+		added = url_map_get_or_insert(graph->url_blacklist, url,
+									  insert_url, &a, id);
+
+	if (added >= 0)
+		bloom_record(graph->seen_filter, added);
+	return added;
+}
+
+/* Atomic insert-if-absent: store URL's node id in *ID, giving it a new
+   one if URL was never seen.  Returns 1 for the one caller that added
+   it, which is the one that should queue it for fetching, and -1 if
+   it could not be added. */
+int webgraph_lookup_or_insert(webgraph_handle handle,
+							  const char *url,
+							  url_fp_t fp,
+							  long *id)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+
+	return lookup_or_insert(graph, url, fp, id);
+}
+
+/* Add the edge SRC_ID -> DEST_ID, recording it for the next checkpoint
+   if LOG is set.  Returns 0, or -1 if memory ran out; then the graph is
+   left as it was. */
+static int add_link_to(struct webgraph *graph,
+					   long src_id,
+					   long dest_id,
+					   int log)
+{
+	struct webgraph_stripe *stripe = &graph->stripes[dest_id % WEBGRAPH_STRIPES];
+	struct webgraph_node *dest = NODE(graph, dest_id);
+	struct vec_in_links *entry;
+	long in_degree;
+
+	entry = (struct vec_in_links *)
+		calloc(1, sizeof(struct vec_in_links));
+	if (entry == NULL)
+		return -1;
+	entry->url_id = src_id;
+
+	pthread_mutex_lock(&stripe->lock);
+
+	if (log)
+	{
+		if (stripe->link_log_len == stripe->link_log_cap)
+		{
+			long cap = stripe->link_log_cap ? 2 * stripe->link_log_cap : 256;
+			struct checkpoint_link *link_log = (struct checkpoint_link *)
+				realloc(stripe->link_log, cap * sizeof(struct checkpoint_link));
+
+			if (link_log == NULL)
+			{
+				pthread_mutex_unlock(&stripe->lock);
+				free(entry);
+				return -1;
+			}
+			stripe->link_log = link_log;
+			stripe->link_log_cap = cap;
+		}
+		stripe->link_log[stripe->link_log_len].src = src_id;
+		stripe->link_log[stripe->link_log_len].dest = dest_id;
+		stripe->link_log_len++;
+	}
+
+	if (dest->in_links_head == NULL)
+		dest->in_links_head = entry;
+	else
+		dest->in_links_tail->next = entry;
+	dest->in_links_tail = entry;
+	in_degree = ++dest->num_in_links;
+
+	if (graph->link_hook)
+		graph->link_hook(graph->link_hook_arg, dest_id, dest->url, in_degree);
+
+	pthread_mutex_unlock(&stripe->lock);
+
+	__atomic_fetch_add(&NODE(graph, src_id)->num_out_links, 1,
+					   __ATOMIC_RELAXED);
+	return 0;
 }
 
-int webgraph_contains(
-						webgraph_handle handle,
-					    char *url
-					 )
+/*
+ * Record all links of page SRC in one go: each distinct destination is
+ * looked up, added if it was never seen, and linked from SRC.  On
+ * return LINKS[i].id holds the destination's id and LINKS[i].is_new
+ * tells whether this call added it.  Repeated destinations within the
+ * batch are linked once; their later copies, and destinations that
+ * could not be added, come back with is_new clear and id -1.
+ *
+ * Returns 0, or -1 if some link could not be recorded for lack of
+ * memory.  A destination added all the same still comes back with its
+ * id and is_new, so that it is queued.
+ */
+int webgraph_add_links(webgraph_handle handle,
+						const char *src,
+						url_fp_t src_fp,
+						struct webgraph_link *links,
+						int n)
 {
 	struct webgraph *graph = (struct webgraph *)handle;
-	int ret;
+	int log = graph->flags & WEBGRAPH_CHECKPOINT;
+	url_fp_t *batch_seen;
+	unsigned long mask;
+	long src_id;
+	int found;
+	int ret = 0;
+	int i, j;
+
+	/* Small open-addressing set of the fingerprints in this batch. */
+	for (mask = 15; mask < 2UL * n; mask = mask * 2 + 1)
+		;
+	batch_seen = (url_fp_t *)calloc(mask + 1, sizeof(url_fp_t));
+
+	found = lookup_id(graph, src, src_fp, &src_id);
+	assert(found);
+
+	for (i = 0; i < n; i++)
+	{
+		struct webgraph_link *l = &links[i];
+		url_fp_t key;
+		unsigned long slot;
+		long dest_id;
+
+		l->id = -1;
+		l->is_new = 0;
+
+		if (batch_seen)
+		{
+			/* url_fingerprint never returns ~0, so fp + 1 is never 0
+			   and 0 can mark a free slot. */
+			key = l->fp + 1;
+			for (slot = key & mask; batch_seen[slot];
+				 slot = (slot + 1) & mask)
+				if (batch_seen[slot] == key)
+					break;
+			if (batch_seen[slot] == key)
+				continue;
+			batch_seen[slot] = key;
+		}
+		else
+		{
+			/* No memory for the set: compare with the links before. */
+			for (j = 0; j < i; j++)
+				if (links[j].fp == l->fp)
+					break;
+			if (j < i)
+				continue;
+		}
+
+		if ((l->is_new = lookup_or_insert(graph, l->url, l->fp,
+										  &dest_id)) < 0)
+		{
+			l->is_new = 0;
+			ret = -1;
+			continue;
+		}
+		l->id = dest_id;
+		if (add_link_to(graph, src_id, dest_id, log) < 0)
+			ret = -1;
+	}
+
+	free(batch_seen);
+	return ret;
+}
+
+/* A copy of the URL of node ID, or NULL if there is no such node. */
+char *webgraph_get_url(webgraph_handle handle, long id)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+	const char *url;
+
+	if (id < 0 || id >= graph_size(graph))
+		return NULL;
+
+	/* An id is handed out just before its URL is stored. */
+	url = __atomic_load_n(&node(graph, id)->url, __ATOMIC_ACQUIRE);
+	return url ? strdup(url) : NULL;
+}
+
+/*
+ * Checkpointing is split in two so that nothing is held up while the
+ * new part is written: webgraph_checkpoint_begin takes the pending edge
+ * logs and the pointers of the new URLs (URL strings never move or
+ * change once added), and webgraph_checkpoint_write encodes and appends
+ * them without any lock.
+ */
+struct webgraph_checkpoint
+{
+	const char **urls;
+	long first_node;
+	long num_nodes;
+	struct checkpoint_link *links;
+	long num_links;
+};
+
+struct webgraph_checkpoint *webgraph_checkpoint_begin(webgraph_handle handle)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+	struct webgraph_checkpoint *cp;
+	long size, end, i, j;
+
+	cp = (struct webgraph_checkpoint *)
+		calloc(1, sizeof(struct webgraph_checkpoint));
 
 	pthread_mutex_lock(&graph->g_lock);
-	ret = hash_table_contains(graph->url_blacklist, url);
+
+	/* Ids are handed out just before their URLs are stored: take the
+	   nodes up to the first one still being added. */
+	size = graph_size(graph);
+	for (end = graph->saved_nodes; end < size; end++)
+		if (__atomic_load_n(&node(graph, end)->url, __ATOMIC_ACQUIRE) == NULL)
+			break;
+
+	cp->first_node = graph->saved_nodes;
+	cp->num_nodes = end - graph->saved_nodes;
+	cp->urls = (const char **)malloc((cp->num_nodes + 1) * sizeof(char *));
+	for (i = 0; i < cp->num_nodes; i++)
+		cp->urls[i] = NODE(graph, cp->first_node + i)->url;
+	graph->saved_nodes = end;
+
+	/* Edges touching nodes past those wait for the next checkpoint. */
+	cp->links = (struct checkpoint_link *)malloc(sizeof(struct checkpoint_link));
+	for (i = 0; i < WEBGRAPH_STRIPES; i++)
+	{
+		struct webgraph_stripe *stripe = &graph->stripes[i];
+		long kept = 0;
+
+		pthread_mutex_lock(&stripe->lock);
+
+		cp->links = (struct checkpoint_link *)
+			realloc(cp->links, (cp->num_links + stripe->link_log_len + 1) *
+					sizeof(struct checkpoint_link));
+		for (j = 0; j < stripe->link_log_len; j++)
+		{
+			struct checkpoint_link *l = &stripe->link_log[j];
+
+			if (l->src < end && l->dest < end)
+				cp->links[cp->num_links++] = *l;
+			else
+				stripe->link_log[kept++] = *l;
+		}
+		stripe->link_log_len = kept;
+
+		pthread_mutex_unlock(&stripe->lock);
+	}
+
 	pthread_mutex_unlock(&graph->g_lock);
 
-	return ret;	
+	return cp;
 }
 
-void webgraph_add_url(
-						 webgraph_handle handle,
-						 const char *url_string
-    				 )
+/* Append the part captured in CP to the files in DIR and advance the
+   counts in M.  CP is freed. */
+int webgraph_checkpoint_write(webgraph_handle handle,
+							  struct webgraph_checkpoint *cp,
+							  const char *dir,
+							  struct checkpoint_manifest *m)
 {
-	struct webgraph *graph = (struct webgraph *)handle;
-	long *id;
-	const char *url = strdup(url_string);
+	struct checkpoint_node *nodes;
+	char *strings, *p;
+	size_t bytes = 0;
+	long i;
+	int ret = -1;
+
+	for (i = 0; i < cp->num_nodes; i++)
+		bytes += strlen(cp->urls[i]) + 1;
+
+	nodes = (struct checkpoint_node *)
+		malloc((cp->num_nodes + 1) * sizeof(struct checkpoint_node));
+	p = strings = (char *)malloc(bytes + 1);
+
+	for (i = 0; i < cp->num_nodes; i++)
+	{
+		size_t len = strlen(cp->urls[i]) + 1;
+
+		nodes[i].fp = url_fingerprint(cp->urls[i]);
+		nodes[i].offset = m->string_bytes + (p - strings);
+		memcpy(p, cp->urls[i], len);
+		p += len;
+	}
+
+	if (checkpoint_append(dir, "strings", strings, bytes) == 0 &&
+		checkpoint_append(dir, "nodes", nodes,
+						  cp->num_nodes * sizeof(struct checkpoint_node)) == 0 &&
+		checkpoint_append(dir, "links", cp->links,
+						  cp->num_links * sizeof(struct checkpoint_link)) == 0)
+	{
+		m->nodes += cp->num_nodes;
+		m->links += cp->num_links;
+		m->string_bytes += bytes;
+		ret = 0;
+	}
+
+	free(nodes);
+	free(strings);
+	free(cp->urls);
+	free(cp->links);
+	free(cp);
+
+	return ret;
+}
 
-	id = (long *)malloc(sizeof(long));
+static void reserve_nodes(struct webgraph *graph, long size);
+
+/* Fill the seen-set of a graph whose nodes were just restored, read
+   from the checkpoint's NODES, on all cores.  Returns the number of
+   distinct URLs. */
+static long build_seen_set(struct webgraph *graph,
+						   const struct checkpoint_node *nodes)
+{
+	long n = graph_size(graph), i, added = -1;
+	long *ids = (long *)malloc((n + 1) * sizeof(long));
+
+	if (ids == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+		ids[i] = i;
+
+	if (graph->fp_blacklist)
+	{
+		url_fp_t *fps = (url_fp_t *)malloc((n + 1) * sizeof(url_fp_t));
+
+		if (fps)
+		{
+			for (i = 0; i < n; i++)
+				fps[i] = nodes[i].fp;
+			added = fp_map_build(graph->fp_blacklist, fps, ids, n, 0);
+		}
+		free(fps);
+	}
+	else
+	{
+		const char **urls = (const char **)malloc((n + 1) * sizeof(char *));
+
+		if (urls)
+		{
+			for (i = 0; i < n; i++)
+				urls[i] = NODE(graph, i)->url;
+			added = url_map_build(graph->url_blacklist, urls, ids, n, 0);
+		}
+		free(urls);
+	}
+
+	free(ids);
+	return added;
+}
+
+/* Rebuild an empty graph from the checkpoint M in DIR. */
+int webgraph_restore(webgraph_handle handle,
+					 const char *dir,
+					 const struct checkpoint_manifest *m)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+	size_t nodes_len = m->nodes * sizeof(struct checkpoint_node);
+	size_t links_len = m->links * sizeof(struct checkpoint_link);
+	const struct checkpoint_node *nodes;
+	const struct checkpoint_link *links;
+	const char *strings;
+	uint64_t i;
+	int ret = -1;
+
+	/* Drop anything past the committed end before appending again. */
+	if (checkpoint_truncate(dir, "nodes", nodes_len) < 0 ||
+		checkpoint_truncate(dir, "links", links_len) < 0 ||
+		checkpoint_truncate(dir, "strings", m->string_bytes) < 0)
+		return -1;
+
+	nodes = (const struct checkpoint_node *)
+		checkpoint_map(dir, "nodes", nodes_len);
+	links = (const struct checkpoint_link *)
+		checkpoint_map(dir, "links", links_len);
+	strings = (const char *)checkpoint_map(dir, "strings", m->string_bytes);
+
+	if ((m->nodes && (nodes == NULL || strings == NULL)) ||
+		(m->links && links == NULL))
+		goto out;
 
 	pthread_mutex_lock(&graph->g_lock);
 
-	if (graph->size >= graph->max_size)
+	if (graph_size(graph) != 0)
+	{
+		pthread_mutex_unlock(&graph->g_lock);
+		goto out;
+	}
+
+	reserve_nodes(graph, m->nodes);
+
+	/* Node ids were given out in order, so node i gets id i back. */
+	for (i = 0; i < m->nodes; i++)
 	{
-		webgraph_resize(graph, 2 * graph->size);
+		if (nodes[i].offset >= m->string_bytes ||
+			memchr(strings + nodes[i].offset, '\0',
+				   m->string_bytes - nodes[i].offset) == NULL)
+			break;
+		NODE(graph, i)->url = strdup(strings + nodes[i].offset);
+		bloom_add_hash(graph->seen_filter, nodes[i].fp);
 	}
+	__atomic_store_n(&graph->size, (long)i, __ATOMIC_RELEASE);
+
+	/* A URL seen twice means the table is corrupt. */
+	ret = i == m->nodes && build_seen_set(graph, nodes) == (long)i ? 0 : -1;
+
+	/* The restored edges are on disk already, so they are not logged. */
+	for (i = 0; i < m->links && ret == 0; i++)
+		if (links[i].src >= 0 && links[i].src < graph_size(graph) &&
+			links[i].dest >= 0 && links[i].dest < graph_size(graph))
+			ret = add_link_to(graph, links[i].src, links[i].dest, 0);
 
-	*id = graph->size++;
-	graph->url_string[*id] = url;
-	hash_table_put(graph->url_blacklist, url, id);
+	graph->saved_nodes = graph_size(graph);
 
 	pthread_mutex_unlock(&graph->g_lock);
+
+	if (ret < 0)
+		fprintf(stderr, "Checkpoint node table is corrupt!\n");
+
+out:
+	checkpoint_unmap((void *)nodes, nodes_len);
+	checkpoint_unmap((void *)links, links_len);
+	checkpoint_unmap((void *)strings, m->string_bytes);
+
+	return ret;
 }
 
-void webgraph_resize(webgraph_handle handle, long size)
+/* FN is called every time an edge is added, with the destination's id,
+   URL and new in-degree.  Calls for one destination are serialized, but
+   those for different destinations may run concurrently.  FN must not
+   call back into the graph, and must be set before any edge is
+   added. */
+void webgraph_set_link_hook(webgraph_handle handle,
+							webgraph_link_hook fn,
+							void *arg)
 {
 	struct webgraph *graph = (struct webgraph *)handle;
-	long num_chars;
-		
-	graph->max_size = size;
-	
-	realloc(graph->url_string, size * sizeof(char *));
-	realloc(graph->in_links_head, size * sizeof(struct vec_in_links *));
-	realloc(graph->in_links_tail, size * sizeof(struct vec_in_links *));
-	realloc(graph->num_out_links, size * sizeof(long));
 
-	num_chars = size / CHAR_BIT + 1;
-	realloc(graph->dangling_pages, num_chars * sizeof(char));
+	graph->link_hook = fn;
+	graph->link_hook_arg = arg;
 }
 
-static int hash_table_cleanup(void *k, void *v, void *dummy)
+static void reserve_nodes(struct webgraph *graph, long size)
 {
-	char *key = (char *)k;
-	long *value = (long *)v;
-	free(key);
-	free(value);
+	long id;
+
+	for (id = 0; id < size; id += NODE_CHUNK_SIZE)
+		if (node(graph, id) == NULL)
+			break;
+}
+
+/* Allocate room for SIZE nodes and their seen-set entries up front.
+   The graph grows as needed regardless. */
+void webgraph_resize(webgraph_handle handle, long size)
+{
+	struct webgraph *graph = (struct webgraph *)handle;
+
+	reserve_nodes(graph, size);
+	if (graph->fp_blacklist)
+		fp_map_reserve(graph->fp_blacklist, size);
+	else
+		url_map_reserve(graph->url_blacklist, size);
 }
 
 void webgraph_delete(webgraph_handle handle)
 {
-	int i;
+	long i;
 	struct webgraph *graph = (struct webgraph *)handle;
-	free(graph->url_string);
-	
+
 	for (i = 0; i < graph->size; i++)
 	{
-		vec_in_links_free(graph->in_links_head[i]);
+		free((char *)NODE(graph, i)->url);
+		vec_in_links_free(NODE(graph, i)->in_links_head);
 	}
-	free(graph->in_links_head);
-	free(graph->in_links_tail);
-	free(graph->num_out_links);
-	free(graph->dangling_pages);
+	for (i = 0; i < NODE_MAX_CHUNKS; i++)
+		free(graph->chunks[i]);
+	free(graph->chunks);
 
 	if (graph->pr)
 		free(graph->pr);
 
-	hash_table_for_each(graph->url_blacklist, 
-						hash_table_cleanup,
-						NULL);
+	/* The string keys are the nodes' URLs, freed above. */
+	if (graph->fp_blacklist)
+		fp_map_delete(graph->fp_blacklist);
+	else
+		url_map_delete(graph->url_blacklist);
+	bloom_delete(graph->seen_filter);
 
-	hash_table_destroy(graph->url_blacklist);	
+	for (i = 0; i < WEBGRAPH_STRIPES; i++)
+	{
+		free(graph->stripes[i].link_log);
+		pthread_mutex_destroy(&graph->stripes[i].lock);
+	}
 	
 	pthread_mutex_destroy(&graph->g_lock);
 	
@@ -245,16 +818,16 @@ static void step(webgraph_handle handle,
 	struct webgraph *graph = (struct webgraph *) handle;
 	
 	for (i = 0; i < n; i++)
-		if (GETBIT(graph->dangling_pages, i))
+		if (NODE(graph, i)->num_out_links == 0)
 			inner_product += p[i];
 	
 	for (i = 0; i < n; i++)
 	{
-		struct vec_in_links *entry = graph->in_links_head[i];
+		struct vec_in_links *entry = NODE(graph, i)->in_links_head;
 		double sum = 0.0;
 		for (; entry != NULL; entry = entry->next)
 			sum += p[entry->url_id] / 
-					graph->num_out_links[entry->url_id];
+					NODE(graph, entry->url_id)->num_out_links;
 		p_new[i] = s * sum + s * inner_product / n + (1 - s) / n;
 		sum_p_new += p_new[i];
 	}
@@ -339,7 +912,7 @@ void print_top_n(webgraph_handle handle, long n)
 
 	for (i = 0; i < graph->size; i++) index[i] = i;
 	
-	for (i = graph->size; i >= 0; i--)
+	for (i = graph->size / 2; i >= 0; i--)
 		heap(graph->pr, index, graph->size, i);	
 	
 	for (i = 0; i < n; i++)
@@ -347,7 +920,7 @@ void print_top_n(webgraph_handle handle, long n)
 		id = index[0];
 		index[0] = index[graph->size - i - 1];
 		printf("No.%ld: %s, Pr:%lf, id:%ld\n", i + 1, 
-				graph->url_string[id], 
+				NODE(graph, id)->url, 
 				graph->pr[id],
 				id); 
 		heap(graph->pr, index, graph->size - i - 1, 0);
@@ -1,10 +1,73 @@
 #ifndef _WEBGRAPH_H
 #define _WEBGRAPH_H
 #include <pthread.h>
+#include "url.h"
+#include "checkpoint.h"
 
 typedef void *webgraph_handle;
 
-extern webgraph_handle webgraph_new(long size);
+/* Key the seen-set by 64-bit URL fingerprints instead of strings. */
+#define WEBGRAPH_FINGERPRINT_KEYS 0x01
+
+/* Log new edges so that checkpoints only write what changed. */
+#define WEBGRAPH_CHECKPOINT 0x02
+
+struct webgraph_checkpoint;
+
+typedef void (*webgraph_link_hook)(void *arg,
+								   long dest_id,
+								   const char *dest_url,
+								   long in_degree);
+
+/* One outgoing link of a page, for webgraph_add_links. */
+struct webgraph_link
+{
+	const char *url;
+	url_fp_t fp;
+	long id;	/* out: destination id */
+	int is_new;	/* out: destination first seen in this call */
+};
+
+extern webgraph_handle webgraph_new(long size, int flags);
+
+extern void webgraph_delete(webgraph_handle handle);
 
 extern long webgraph_get_size(webgraph_handle handle);
+
+extern void webgraph_resize(webgraph_handle handle, long size);
+
+extern int webgraph_lookup_or_insert(webgraph_handle handle,
+									 const char *url,
+									 url_fp_t fp,
+									 long *id);
+
+extern char *webgraph_get_url(webgraph_handle handle, long id);
+
+extern int webgraph_add_links(webgraph_handle handle,
+							  const char *src,
+							  url_fp_t src_fp,
+							  struct webgraph_link *links,
+							  int n);
+
+extern struct webgraph_checkpoint *
+webgraph_checkpoint_begin(webgraph_handle handle);
+
+extern int webgraph_checkpoint_write(webgraph_handle handle,
+									 struct webgraph_checkpoint *cp,
+									 const char *dir,
+									 struct checkpoint_manifest *m);
+
+extern int webgraph_restore(webgraph_handle handle,
+							const char *dir,
+							const struct checkpoint_manifest *m);
+
+extern void webgraph_set_link_hook(webgraph_handle handle,
+								   webgraph_link_hook fn,
+								   void *arg);
+
+extern double webgraph_filter_fp_rate(webgraph_handle handle);
+
+extern void pagerank(webgraph_handle handle, double s, double tolerance);
+
+extern void print_top_n(webgraph_handle handle, long n);
 #endif